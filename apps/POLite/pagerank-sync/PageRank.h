@@ -4,6 +4,7 @@
 
 #define POLITE_DUMP_STATS
 #define POLITE_COUNT_MSGS
+#define POLITE_REDUCE
 #define NUM_ITERATIONS 5
 
 #include <POLite.h>
@@ -67,6 +68,11 @@ struct PageRankDevice : PDevice<PageRankState, None, PageRankMessage> {
     msg->val = s->score;
     return true;
   }
+
+  // Combine scores on termination
+  static inline void reduce(PageRankMessage* acc, PageRankMessage* msg) {
+    acc->val += msg->val;
+  }
 };
 
 #endif
@@ -77,16 +77,13 @@ int main(int argc, char **argv)
   // Consume performance stats
   politeSaveStats(&hostLink, "stats.txt");
 
-  // Wait for response
+  // Wait for response (scores are combined on-device)
   PMessage<PageRankMessage> msg;
-  for (uint32_t i = 0; i < graph.numDevices; i++) {
-    hostLink.recvMsg(&msg, sizeof(msg));
-    gscore += msg.payload.val;
-    if (i == 0) {
-      // Get finish time
-      gettimeofday(&finish, NULL);
-    }
-  }
+  hostLink.recvMsg(&msg, sizeof(msg));
+  gscore = msg.payload.val;
+
+  // Get finish time
+  gettimeofday(&finish, NULL);
  
   printf("Done\n");
   printf("score=%.8f\n", gscore);
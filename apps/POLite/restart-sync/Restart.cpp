@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: BSD-2-Clause
+#include "Restart.h"
+
+#include <tinsel.h>
+#include <POLite.h>
+
+typedef PThread<
+          RestartDevice,
+          RestartState,    // State
+          None,            // Edge label
+          int32_t          // Message
+        > RestartThread;
+
+int main()
+{
+  // Point thread structure at base of thread's heap
+  RestartThread* thread = (RestartThread*) tinselHeapBaseSRAM();
+
+  // Invoke interpreter
+  thread->run();
+
+  return 0;
+}
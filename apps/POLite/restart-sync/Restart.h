@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: BSD-2-Clause
+#ifndef _Restart_H_
+#define _Restart_H_
+
+#include <POLite.h>
+
+// Vertex state
+struct RestartState {
+  // Has min seen changed?
+  bool changed;
+  // The min label seen
+  int32_t min;
+};
+
+// Vertex behaviour (HashMin: each vertex learns the min label in its
+// connected component)
+struct RestartDevice : PDevice<RestartState,None,int32_t> {
+  inline void init() {
+    *readyToSend = Pin(0);
+  }
+  inline void send(int32_t* msg) {
+    *msg = s->min;
+    *readyToSend = No;
+  }
+  inline void recv(int32_t* min, None* weight) {
+    if (*min < s->min) {
+      s->min = *min;
+      s->changed = true;
+    }
+  }
+  inline bool step() {
+    if (s->changed) {
+      s->changed = false;
+      *readyToSend = Pin(0);
+      return true;
+    }
+    else
+      return false;
+  }
+  inline bool finish(int32_t* msg) {
+    *msg = s->min;
+    return true;
+  }
+};
+
+#endif
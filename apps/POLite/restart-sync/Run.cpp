@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Test of PGraph::restart() and PGraph::readStates(): run HashMin
+// twice on the same graph, with different initial labels, and check
+// both the results sent by the finish handlers and the states read
+// back.  Vertex states are mapped to DRAM, so the test fails if the
+// threads do not write back their caches before the host accesses
+// the vertex region.
+
+#include "Restart.h"
+
+#include <HostLink.h>
+#include <POLite.h>
+
+#include <stdlib.h>
+#include <assert.h>
+
+// Find root of vertex in union-find forest
+static uint32_t findRoot(uint32_t* parent, uint32_t v)
+{
+  while (parent[v] != v) v = parent[v] = parent[parent[v]];
+  return v;
+}
+
+// Run application to termination and check results against expected
+static bool check(PGraph<RestartDevice, RestartState, None, int32_t>* graph,
+                  HostLink* hostLink, int32_t* expected)
+{
+  bool ok = true;
+
+  // Receive the min label of each vertex from its finish handler
+  int64_t sum = 0, expectedSum = 0;
+  for (uint32_t i = 0; i < graph->numDevices; i++) {
+    PMessage<int32_t> msg;
+    hostLink->recvMsg(&msg, sizeof(msg));
+    sum += msg.payload;
+    expectedSum += expected[i];
+  }
+  if (sum != expectedSum) {
+    printf("Sum = %ld, expected %ld\n", sum, expectedSum);
+    ok = false;
+  }
+
+  // Read states back and compare
+  graph->readStates(hostLink);
+  uint32_t numWrong = 0;
+  for (uint32_t i = 0; i < graph->numDevices; i++)
+    if (graph->devices[i]->state.min != expected[i]) numWrong++;
+  if (numWrong > 0) {
+    printf("%u of %u states read back are wrong\n",
+      numWrong, graph->numDevices);
+    ok = false;
+  }
+
+  return ok;
+}
+
+int main(int argc, char**argv)
+{
+  // Number of vertices
+  uint32_t n = argc > 1 ? atoi(argv[1]) : 10000;
+
+  // Connection to tinsel machine
+  HostLink hostLink;
+
+  // Create POETS graph
+  PGraph<RestartDevice, RestartState, None, int32_t> graph;
+  graph.mapVerticesToDRAM = true;
+  for (uint32_t i = 0; i < n; i++) graph.newDevice();
+
+  // Random undirected edges within blocks of 100 vertices, giving
+  // many connected components
+  uint32_t* parent = new uint32_t [n];
+  for (uint32_t i = 0; i < n; i++) parent[i] = i;
+  srand(1);
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t base = i - i%100;
+    uint32_t len = n - base < 100 ? n - base : 100;
+    for (uint32_t j = 0; j < 2; j++) {
+      uint32_t k = base + rand() % len;
+      if (k == i) continue;
+      graph.addEdge(i, 0, k);
+      graph.addEdge(k, 0, i);
+      parent[findRoot(parent, i)] = findRoot(parent, k);
+    }
+  }
+
+  // Prepare mapping from graph to hardware
+  graph.map();
+
+  // Expected results for labels given by label(i): min over component
+  int32_t* label = new int32_t [n];
+  int32_t* compMin = new int32_t [n];
+  int32_t* expected = new int32_t [n];
+
+  // First run: label each vertex with its id
+  for (uint32_t i = 0; i < n; i++) label[i] = i;
+  for (uint32_t i = 0; i < n; i++) compMin[i] = INT32_MAX;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t r = findRoot(parent, i);
+    if (label[i] < compMin[r]) compMin[r] = label[i];
+  }
+  for (uint32_t i = 0; i < n; i++)
+    expected[i] = compMin[findRoot(parent, i)];
+  for (uint32_t i = 0; i < n; i++) {
+    graph.devices[i]->state.changed = false;
+    graph.devices[i]->state.min = label[i];
+  }
+  graph.write(&hostLink);
+  hostLink.boot("code.v", "data.v");
+  hostLink.go();
+  bool ok = check(&graph, &hostLink, expected);
+  printf("Run 1: %s\n", ok ? "OK" : "FAILED");
+
+  // Second run: reverse the labels, so every component's min changes
+  for (uint32_t i = 0; i < n; i++) label[i] = 2*n - 1 - i;
+  for (uint32_t i = 0; i < n; i++) compMin[i] = INT32_MAX;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t r = findRoot(parent, i);
+    if (label[i] < compMin[r]) compMin[r] = label[i];
+  }
+  for (uint32_t i = 0; i < n; i++)
+    expected[i] = compMin[findRoot(parent, i)];
+  for (uint32_t i = 0; i < n; i++) {
+    graph.devices[i]->state.changed = false;
+    graph.devices[i]->state.min = label[i];
+    graph.markDirty(i);
+  }
+  graph.restart(&hostLink);
+  hostLink.go();
+  bool ok2 = check(&graph, &hostLink, expected);
+  printf("Run 2: %s\n", ok2 ? "OK" : "FAILED");
+
+  delete [] parent;
+  delete [] label;
+  delete [] compMin;
+  delete [] expected;
+
+  if (!ok || !ok2) exit(EXIT_FAILURE);
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Convert a text edge list to the binary format understood by
+// EdgeList::read(), which can be memory-mapped rather than parsed
+//
+// Build with: g++ -O2 -I ../../../include EdgeListToBin.cpp -o EdgeListToBin
+
+#include <stdio.h>
+#include <EdgeList.h>
+
+int main(int argc, char *argv[])
+{
+  if (argc != 3) {
+    printf("Usage: EdgeListToBin <input.txt> <output.bin>\n");
+    return -1;
+  }
+
+  EdgeList net;
+  net.readText(argv[1]);
+  net.writeBinary(argv[2]);
+  printf("Wrote %u nodes and %u edges to %s\n",
+    net.numNodes, net.numEdges, argv[2]);
+
+  return 0;
+}
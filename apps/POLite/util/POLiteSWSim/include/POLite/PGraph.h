@@ -329,6 +329,8 @@ struct PDevice {
   void recv(M* msg, E* edge);
   bool step();
   bool finish(volatile M* msg);
+  // Combine msg into acc (only used when POLITE_REDUCE is defined)
+  static void reduce(M* acc, M* msg);
 };
 
 template <typename DeviceType, typename S, typename E, typename M>
@@ -632,12 +634,30 @@ public:
 
         time_now++;
 
+#ifdef POLITE_REDUCE
+        // Combine results of finish handlers into a single message
+        M acc{};
+        bool any=false;
+        for(unsigned i=0; i<numDevices; i++){
+            M msg;
+            if(device_states[i].finish(&msg)){
+                if(any){
+                    DeviceType::reduce(&acc, &msg);
+                }else{
+                    acc=msg;
+                    any=true;
+                }
+            }
+        }
+        send_cb(&acc, sizeof(M));
+#else
         for(unsigned i=0; i<numDevices; i++){
             M msg;
             if(device_states[i].finish(&msg)){
                 send_cb(&msg, sizeof(M));
             }
         }
+#endif
 
         return false;
     }
@@ -72,6 +72,37 @@ int main()
           tinselSend(hostId, msgOut);
         }
       }
+      else if (cmd == StoreBlockCmd || cmd == LoadBlockCmd) {
+        // Store words from the messages that follow to data memory, or
+        // load words from data memory into max-sized messages to the host
+        // (A single loop serves both, to keep the boot image small)
+        int n = msgIn->args[0];
+        int store = cmd == StoreBlockCmd;
+        tinselSetLen(TinselMaxFlitsPerMsg-1);
+        while (n > 0) {
+          volatile uint32_t* src = (uint32_t*) addrReg;
+          volatile uint32_t* dst = msgOut;
+          if (store) {
+            tinselFree(msgIn);
+            tinselWaitUntil(TINSEL_CAN_RECV);
+            msgIn = tinselRecv();
+            src = (uint32_t*) msgIn;
+            dst = (uint32_t*) addrReg;
+          }
+          else
+            tinselWaitUntil(TINSEL_CAN_SEND);
+          for (int i = 0; i < (1 << TinselLogWordsPerMsg); i++) {
+            dst[i] = src[i];
+            addrReg += 4;
+          }
+          if (store)
+            lastDataStoreAddr = addrReg - 4;
+          else
+            tinselSend(hostId, msgOut);
+          n--;
+        }
+        tinselSetLen(0);
+      }
       else if (cmd == SetAddrCmd) {
         // Set address register
         addrReg = msgIn->args[0];
@@ -641,6 +641,81 @@ void HostLink::store(uint32_t meshX, uint32_t meshY,
   }
 }
 
+// Store words to remote memory on a given board via given core,
+// streaming them as max-sized messages after a single command
+void HostLink::storeBlock(uint32_t meshX, uint32_t meshY,
+                          uint32_t coreId, uint32_t numWords, uint32_t* data)
+{
+  uint32_t dest = toAddr(meshX, meshY, coreId, 0);
+  uint32_t numMsgs = numWords >> TinselLogWordsPerMsg;
+
+  if (numMsgs > 0) {
+    BootReq req;
+    memset(&req, 0, sizeof(BootReq)); // Keep valgrind happy about un-init bytes.
+
+    req.cmd = StoreBlockCmd;
+    req.numArgs = 1;
+    req.args[0] = numMsgs;
+    send(dest, 1, &req);
+    for (uint32_t i = 0; i < numMsgs; i++)
+      send(dest, TinselMaxFlitsPerMsg, &data[i << TinselLogWordsPerMsg]);
+  }
+
+  // Store any remaining words individually
+  uint32_t blockWords = numMsgs << TinselLogWordsPerMsg;
+  if (blockWords < numWords)
+    store(meshX, meshY, coreId, numWords - blockWords, &data[blockWords]);
+}
+
+// Request words from remote memory on a given board via given core
+// (Whole messages are requested using LoadBlockCmd, the rest using LoadCmd)
+void HostLink::loadRequest(uint32_t meshX, uint32_t meshY,
+                           uint32_t coreId, uint32_t numWords)
+{
+  BootReq req;
+  memset(&req, 0, sizeof(BootReq)); // Keep valgrind happy about un-init bytes.
+
+  uint32_t dest = toAddr(meshX, meshY, coreId, 0);
+  uint32_t numMsgs = numWords >> TinselLogWordsPerMsg;
+  uint32_t rest = numWords - (numMsgs << TinselLogWordsPerMsg);
+  req.numArgs = 1;
+  if (numMsgs > 0) {
+    req.cmd = LoadBlockCmd;
+    req.args[0] = numMsgs;
+    send(dest, 1, &req);
+  }
+  if (rest > 0) {
+    req.cmd = LoadCmd;
+    req.args[0] = rest;
+    send(dest, 1, &req);
+  }
+}
+
+// Receive words requested by loadRequest
+void HostLink::loadResponse(uint32_t numWords, uint32_t* data)
+{
+  // Make sure the request has been sent
+  if (useSendBuffer) flush();
+
+  // Whole messages
+  uint32_t numMsgs = numWords >> TinselLogWordsPerMsg;
+  if (numMsgs > 0) recvBulk(numMsgs, data);
+
+  // Responses to LoadCmd carry up to 4 words each
+  for (uint32_t i = numMsgs << TinselLogWordsPerMsg; i < numWords; i += 4) {
+    uint32_t n = numWords - i > 4 ? 4 : numWords - i;
+    recvMsg(&data[i], n * sizeof(uint32_t));
+  }
+}
+
+// Load words from remote memory on a given board via given core
+void HostLink::load(uint32_t meshX, uint32_t meshY,
+                    uint32_t coreId, uint32_t numWords, uint32_t* data)
+{
+  loadRequest(meshX, meshY, coreId, numWords);
+  loadResponse(numWords, data);
+}
+
 // Power-on self test
 bool HostLink::powerOnSelfTest()
 {
@@ -151,6 +151,24 @@ class HostLink {
   void store(uint32_t meshX, uint32_t meshY,
              uint32_t coreId, uint32_t numWords, uint32_t* data);
 
+  // Store words to remote memory on given board via given core,
+  // streaming them as max-sized messages after a single command
+  void storeBlock(uint32_t meshX, uint32_t meshY,
+                  uint32_t coreId, uint32_t numWords, uint32_t* data);
+
+  // Request words from remote memory on given board via given core
+  // (The words are returned in order by a matching call to loadResponse,
+  // which must be made before requesting from any other core)
+  void loadRequest(uint32_t meshX, uint32_t meshY,
+                   uint32_t coreId, uint32_t numWords);
+
+  // Receive words requested by loadRequest
+  void loadResponse(uint32_t numWords, uint32_t* data);
+
+  // Load words from remote memory on given board via given core
+  void load(uint32_t meshX, uint32_t meshY,
+            uint32_t coreId, uint32_t numWords, uint32_t* data);
+
   // Finer-grained control over application loading and execution
   // ------------------------------------------------------------
 
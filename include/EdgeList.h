@@ -4,11 +4,36 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
 
+// Edge lists can be read from a text file containing whitespace-separated
+// (source, destination) pairs, or from a binary file, which is
+// memory-mapped rather than parsed.  The binary format is:
+//
+//   uint32_t magic (EdgeListMagic)
+//   uint32_t version (EdgeListVersion)
+//   uint64_t numNodes
+//   uint64_t numEdges
+//   uint64_t offsets[numNodes+1]
+//   uint32_t data[numNodes+numEdges]
+//
+// where data[offsets[i]] holds the number of neighbours of node i,
+// followed by the neighbours themselves, i.e. the same layout as
+// EdgeList::neighbours[i].  Binary files are written using
+// EdgeList::writeBinary(), e.g. by apps/POLite/util/EdgeListToBin.
+
+const uint32_t EdgeListMagic = 0x42474445; // "EDGB"
+const uint32_t EdgeListVersion = 1;
+
 struct EdgeList {
   // Number of nodes and edges
   uint32_t numNodes;
@@ -18,8 +43,8 @@ struct EdgeList {
   // First element of each array holds the number of neighbours
   uint32_t** neighbours;
 
-  // Read network from file
-  void read(const char* filename)
+  // Read network from text file
+  void readText(const char* filename)
   {
     std::fstream file(filename, std::ios_base::in);
     std::vector<uint32_t> vec;
@@ -38,27 +63,132 @@ struct EdgeList {
     numEdges >>= 1;
 
     uint32_t* count = (uint32_t*) calloc(numNodes, sizeof(uint32_t));
-    for (int i = 0; i < vec.size(); i+=2) {
+    for (size_t i = 0; i < vec.size(); i+=2) {
       count[vec[i]]++;
     }
 
     // Create mapping from node id to neighbours
     neighbours = (uint32_t**) calloc(numNodes, sizeof(uint32_t*));
-    for (int i = 0; i < numNodes; i++) {
+    for (uint32_t i = 0; i < numNodes; i++) {
       neighbours[i] = (uint32_t*) calloc(count[i]+1, sizeof(uint32_t));
       neighbours[i][0] = count[i];
     }
-    for (int i = 0; i < vec.size(); i+=2) {
+    for (size_t i = 0; i < vec.size(); i+=2) {
       uint32_t src = vec[i];
       uint32_t dst = vec[i+1];
       neighbours[src][count[src]--] = dst;
     }
- 
+
     // Release
     free(count);
     file.close();
   }
 
+  // Read network from binary file
+  void readBinary(const char* filename)
+  {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "EdgeList: can't open '%s'\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    fstat(fd, &st);
+    uint64_t size = st.st_size;
+    const uint64_t headerSize = 24;
+    if (size < headerSize) {
+      fprintf(stderr, "EdgeList: '%s' is truncated\n", filename);
+      exit(EXIT_FAILURE);
+    }
+
+    // Map the file (copy-on-write, so that callers may modify it)
+    uint8_t* base = (uint8_t*) mmap(NULL, size,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+      fprintf(stderr, "EdgeList: can't map '%s'\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    // Check header
+    uint32_t* header32 = (uint32_t*) base;
+    uint64_t* header64 = (uint64_t*) (base + 8);
+    uint64_t nodes = header64[0];
+    uint64_t edges = header64[1];
+    if (header32[0] != EdgeListMagic || header32[1] != EdgeListVersion) {
+      fprintf(stderr, "EdgeList: '%s' has unknown format\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    if (nodes > 0xffffffff || edges > 0xffffffff ||
+          size != headerSize + 8*(nodes+1) + 4*(nodes+edges)) {
+      fprintf(stderr, "EdgeList: '%s' has unexpected size\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    numNodes = nodes;
+    numEdges = edges;
+
+    // Check that each node's neighbours lie within its own slice of data
+    uint64_t* offsets = (uint64_t*) (base + headerSize);
+    uint32_t* data = (uint32_t*) (base + headerSize + 8*(nodes+1));
+    bool ok = offsets[nodes] == nodes + edges;
+    for (uint64_t i = 0; ok && i < nodes; i++)
+      ok = offsets[i] < offsets[i+1] && offsets[i+1] <= nodes + edges &&
+             offsets[i] + data[offsets[i]] + 1 <= offsets[i+1];
+    if (! ok) {
+      fprintf(stderr, "EdgeList: '%s' has invalid offsets\n", filename);
+      exit(EXIT_FAILURE);
+    }
+
+    // Create mapping from node id to neighbours
+    neighbours = (uint32_t**) calloc(numNodes, sizeof(uint32_t*));
+    for (uint32_t i = 0; i < numNodes; i++)
+      neighbours[i] = &data[offsets[i]];
+  }
+
+  // Read network from file (binary or text)
+  void read(const char* filename)
+  {
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) {
+      fprintf(stderr, "EdgeList: can't open '%s'\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    uint32_t magic = 0;
+    size_t ok = fread(&magic, sizeof(uint32_t), 1, fp);
+    fclose(fp);
+    if (ok == 1 && magic == EdgeListMagic)
+      readBinary(filename);
+    else
+      readText(filename);
+  }
+
+  // Write network to binary file
+  void writeBinary(const char* filename)
+  {
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) {
+      fprintf(stderr, "EdgeList: can't create '%s'\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    uint32_t header32[2] = { EdgeListMagic, EdgeListVersion };
+    uint64_t header64[2] = { numNodes, numEdges };
+    bool ok = fwrite(header32, sizeof(uint32_t), 2, fp) == 2;
+    ok = ok && fwrite(header64, sizeof(uint64_t), 2, fp) == 2;
+    uint64_t offset = 0;
+    for (uint32_t i = 0; ok && i <= numNodes; i++) {
+      ok = fwrite(&offset, sizeof(uint64_t), 1, fp) == 1;
+      if (i < numNodes) offset += neighbours[i][0] + 1;
+    }
+    for (uint32_t i = 0; ok && i < numNodes; i++) {
+      uint32_t n = neighbours[i][0] + 1;
+      ok = fwrite(neighbours[i], sizeof(uint32_t), n, fp) == n;
+    }
+    if (fclose(fp) != 0 || !ok) {
+      fprintf(stderr, "EdgeList: error writing '%s'\n", filename);
+      exit(EXIT_FAILURE);
+    }
+  }
+
   // Determine max fan-out
   uint32_t maxFanOut() {
     uint32_t max = 0;
@@ -3,97 +3,322 @@
 #define _GRAPH_H_
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <algorithm>
 #include <POLite/Seq.h>
 
 typedef uint32_t NodeId;
 typedef int32_t PinId;
 typedef uint32_t NodeLabel;
 
+// A graph is built by adding nodes and edges, and is then frozen into
+// compressed sparse row (CSR) form, with contiguous offset, neighbour,
+// and pin arrays.  No nodes or edges may be added once frozen.
 struct Graph {
-  // Incoming and outgoing edges
-  // Invariant: these two sequences always have equal length
-  Seq<Seq<NodeId>*>* incoming;
-  Seq<Seq<NodeId>*>* outgoing;
+  // Number of nodes
+  uint32_t numNodes;
 
-  // Each outgoing edge has a pin id
-  // Invariant: this sequence always has the same structure as 'outgoing'
-  Seq<Seq<PinId>*>* pins;
+  // Number of edges
+  uint64_t numEdges;
 
   // Each node has a label
   Seq<NodeLabel>* labels;
 
+  // Has the graph been frozen?
+  bool frozen;
+
+  // Edges, in the order they were added
+  // (Released when the graph is frozen)
+  Seq<NodeId>* edgeSrcs;
+  Seq<NodeId>* edgeDsts;
+  Seq<PinId>* edgePins;
+
+  // Fan-in and fan-out of each node
+  // (Released when the graph is frozen)
+  Seq<uint32_t>* inCount;
+  Seq<uint32_t>* outCount;
+
+  // Outgoing edges of node n, with their pin ids, are stored in
+  // outNeighbours and outPins from index outOffsets[n] to
+  // outOffsets[n+1] (exclusive), in the order they were added.
+  // Incoming edges are stored likewise in inNeighbours.
+  // (Not valid until the graph is frozen)
+  uint64_t* outOffsets;
+  NodeId* outNeighbours;
+  PinId* outPins;
+  uint64_t* inOffsets;
+  NodeId* inNeighbours;
+
   // Constructor
   Graph() {
     const uint32_t initialCapacity = 4096;
-    incoming = new Seq<Seq<NodeId>*> (initialCapacity);
-    outgoing = new Seq<Seq<NodeId>*> (initialCapacity);
-    pins = new Seq<Seq<PinId>*> (initialCapacity);
+    numNodes = 0;
+    numEdges = 0;
     labels = new Seq<NodeLabel> (initialCapacity);
+    frozen = false;
+    edgeSrcs = new Seq<NodeId> (initialCapacity);
+    edgeDsts = new Seq<NodeId> (initialCapacity);
+    edgePins = new Seq<PinId> (initialCapacity);
+    inCount = new Seq<uint32_t> (initialCapacity);
+    outCount = new Seq<uint32_t> (initialCapacity);
+    outOffsets = NULL;
+    outNeighbours = NULL;
+    outPins = NULL;
+    inOffsets = NULL;
+    inNeighbours = NULL;
   }
 
   // Deconstructor
   ~Graph() {
-    for (uint32_t i = 0; i < incoming->numElems; i++) {
-      delete incoming->elems[i];
-      delete outgoing->elems[i];
-      delete pins->elems[i];
-    }
-    delete incoming;
-    delete outgoing;
-    delete pins;
     delete labels;
+    releaseBuilder();
+    if (outOffsets != NULL) delete [] outOffsets;
+    if (outNeighbours != NULL) delete [] outNeighbours;
+    if (outPins != NULL) delete [] outPins;
+    if (inOffsets != NULL) delete [] inOffsets;
+    if (inNeighbours != NULL) delete [] inNeighbours;
+  }
+
+  // Release structures used only while building the graph
+  void releaseBuilder() {
+    if (edgeSrcs != NULL) { delete edgeSrcs; edgeSrcs = NULL; }
+    if (edgeDsts != NULL) { delete edgeDsts; edgeDsts = NULL; }
+    if (edgePins != NULL) { delete edgePins; edgePins = NULL; }
+    if (inCount != NULL) { delete inCount; inCount = NULL; }
+    if (outCount != NULL) { delete outCount; outCount = NULL; }
+  }
+
+  // Check that the graph can still be modified
+  void checkNotFrozen() {
+    if (frozen) {
+      printf("Graph: can't add nodes or edges once graph is frozen\n");
+      exit(EXIT_FAILURE);
+    }
   }
 
   // Add new node
   NodeId newNode() {
-    const uint32_t initialCapacity = 8;
-    incoming->append(new Seq<NodeId> (initialCapacity));
-    outgoing->append(new Seq<NodeId> (initialCapacity));
-    pins->append(new Seq<PinId> (initialCapacity));
-    labels->append(incoming->numElems - 1);
-    return incoming->numElems - 1;
+    checkNotFrozen();
+    labels->append(numNodes);
+    inCount->append(0);
+    outCount->append(0);
+    return numNodes++;
+  }
+
+  // Add given number of new nodes
+  // Returns id of first new node
+  NodeId newNodes(uint32_t n) {
+    checkNotFrozen();
+    NodeId first = numNodes;
+    extendSeq(labels, n);
+    extendSeq(inCount, n);
+    extendSeq(outCount, n);
+    for (uint32_t i = 0; i < n; i++) {
+      labels->elems[first+i] = first+i;
+      inCount->elems[first+i] = 0;
+      outCount->elems[first+i] = 0;
+    }
+    numNodes += n;
+    return first;
   }
 
   // Set node label
   void setLabel(NodeId id, NodeLabel lab) {
-    assert(id < labels->numElems);
+    assert(id < (NodeId) labels->numElems);
     labels->elems[id] = lab;
   }
 
   // Add edge using output pin 0
   void addEdge(NodeId x, NodeId y) {
-    outgoing->elems[x]->append(y);
-    pins->elems[x]->append(0);
-    incoming->elems[y]->append(x);
+    addEdge(x, 0, y);
   }
 
   // Add edge using given output pin
   void addEdge(NodeId x, PinId p, NodeId y) {
-    outgoing->elems[x]->append(y);
-    pins->elems[x]->append(p);
-    incoming->elems[y]->append(x);
+    checkNotFrozen();
+    assert(x < numNodes && y < numNodes);
+    if (numEdges + 1 > 0x7fffffff) {
+      printf("Graph: too many edges\n");
+      exit(EXIT_FAILURE);
+    }
+    // Grow using extendSeq(), which caps the capacity, since doubling
+    // would overflow Seq's int sizes beyond 2^30 edges
+    extendSeq(edgeSrcs, 1);
+    extendSeq(edgePins, 1);
+    extendSeq(edgeDsts, 1);
+    edgeSrcs->elems[numEdges] = x;
+    edgePins->elems[numEdges] = p;
+    edgeDsts->elems[numEdges] = y;
+    outCount->elems[x]++;
+    inCount->elems[y]++;
+    numEdges++;
+  }
+
+  // Add given number of edges in bulk, equivalent to calling
+  // addEdge(srcs[i], pins[i], dsts[i]) for each i in order
+  // (If pins is NULL, output pin 0 is used for every edge)
+  void addEdges(uint64_t n, const NodeId* srcs,
+                  const PinId* pins, const NodeId* dsts) {
+    checkNotFrozen();
+    if (numEdges + n > 0x7fffffff) {
+      printf("Graph: too many edges\n");
+      exit(EXIT_FAILURE);
+    }
+    // Check node ids
+    uint64_t bad = 0;
+    #pragma omp parallel for reduction(+:bad)
+    for (uint64_t i = 0; i < n; i++)
+      bad += srcs[i] >= numNodes || dsts[i] >= numNodes;
+    if (bad > 0) {
+      printf("Graph: edge refers to non-existent node\n");
+      exit(EXIT_FAILURE);
+    }
+    // Size the builder once, then fill it in parallel
+    uint64_t base = numEdges;
+    extendSeq(edgeSrcs, n);
+    extendSeq(edgeDsts, n);
+    extendSeq(edgePins, n);
+    uint32_t* in = inCount->elems;
+    uint32_t* out = outCount->elems;
+    #pragma omp parallel for
+    for (uint64_t i = 0; i < n; i++) {
+      edgeSrcs->elems[base+i] = srcs[i];
+      edgeDsts->elems[base+i] = dsts[i];
+      edgePins->elems[base+i] = pins == NULL ? 0 : pins[i];
+      __atomic_fetch_add(&out[srcs[i]], 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&in[dsts[i]], 1, __ATOMIC_RELAXED);
+    }
+    numEdges += n;
+  }
+
+  // Extend sequence by n elements, without over-allocating when
+  // a single large extension is made
+  template <typename T> void extendSeq(Seq<T>* seq, uint64_t n) {
+    uint64_t needed = seq->numElems + n;
+    if (needed > (uint64_t) seq->maxElems) {
+      uint64_t grown = seq->maxElems + seq->maxElems/2;
+      if (grown > 0x7fffffff) grown = 0x7fffffff;
+      seq->setCapacity(needed > grown ? needed : grown);
+    }
+    seq->numElems = needed;
+  }
+
+  // Given per-edge data in the order that edges were added, return a
+  // new array holding the same data in the order of outNeighbours
+  // (Only valid before the graph is frozen)
+  template <typename T> T* toCSROrder(T* data) {
+    assert(!frozen);
+    uint64_t* offsets = computeOffsets(outCount);
+    uint32_t* order = computeOrder(edgeSrcs->elems, offsets);
+    T* result = new T [numEdges];
+    #pragma omp parallel for
+    for (uint64_t i = 0; i < numEdges; i++)
+      result[i] = data[order[i]];
+    delete [] order;
+    delete [] offsets;
+    return result;
+  }
+
+  // Convert per-node counts to offsets
+  uint64_t* computeOffsets(Seq<uint32_t>* count) {
+    uint64_t* offsets = new uint64_t [numNodes+1];
+    offsets[0] = 0;
+    for (uint32_t i = 0; i < numNodes; i++)
+      offsets[i+1] = offsets[i] + count->elems[i];
+    return offsets;
+  }
+
+  // Group edges by given key (source or destination node), preserving
+  // the order in which edges were added.  Returns the index of the edge
+  // at each position.  Edges are placed in parallel, then the edges of
+  // each node are sorted back into their original order.
+  uint32_t* computeOrder(NodeId* keys, uint64_t* offsets) {
+    uint32_t* order = new uint32_t [numEdges];
+    uint64_t* next = new uint64_t [numNodes];
+    #pragma omp parallel for
+    for (uint32_t i = 0; i < numNodes; i++) next[i] = offsets[i];
+    #pragma omp parallel for
+    for (uint64_t e = 0; e < numEdges; e++)
+      order[__atomic_fetch_add(&next[keys[e]], 1, __ATOMIC_RELAXED)] = e;
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (uint32_t i = 0; i < numNodes; i++)
+      std::sort(&order[offsets[i]], &order[offsets[i+1]]);
+    delete [] next;
+    return order;
+  }
+
+  // Convert to CSR form, and release the builder
+  // (Has no effect if the graph is already frozen)
+  void freeze() {
+    if (frozen) return;
+    // Outgoing edges
+    outOffsets = computeOffsets(outCount);
+    uint32_t* order = computeOrder(edgeSrcs->elems, outOffsets);
+    outNeighbours = new NodeId [numEdges];
+    outPins = new PinId [numEdges];
+    #pragma omp parallel for
+    for (uint64_t i = 0; i < numEdges; i++) {
+      outNeighbours[i] = edgeDsts->elems[order[i]];
+      outPins[i] = edgePins->elems[order[i]];
+    }
+    delete [] order;
+    // Incoming edges
+    inOffsets = computeOffsets(inCount);
+    order = computeOrder(edgeDsts->elems, inOffsets);
+    inNeighbours = new NodeId [numEdges];
+    #pragma omp parallel for
+    for (uint64_t i = 0; i < numEdges; i++)
+      inNeighbours[i] = edgeSrcs->elems[order[i]];
+    delete [] order;
+    releaseBuilder();
+    frozen = true;
+  }
+
+  // Outgoing edges of given node (there are fanOut(id) of them)
+  // (Only valid once the graph is frozen)
+  inline NodeId* outgoing(NodeId id) {
+    assert(frozen);
+    return &outNeighbours[outOffsets[id]];
+  }
+
+  // Pin ids of outgoing edges of given node
+  // (Only valid once the graph is frozen)
+  inline PinId* pins(NodeId id) {
+    assert(frozen);
+    return &outPins[outOffsets[id]];
+  }
+
+  // Incoming edges of given node (there are fanIn(id) of them)
+  // (Only valid once the graph is frozen)
+  inline NodeId* incoming(NodeId id) {
+    assert(frozen);
+    return &inNeighbours[inOffsets[id]];
   }
 
   // Determine max pin used by given node
   // (Returns -1 if node has no outgoing edges)
+  // (Only valid once the graph is frozen)
   PinId maxPin(NodeId x) {
     int max = -1;
-    for (uint32_t i = 0; i < pins->elems[x]->numElems; i++) {
-      if (pins->elems[x]->elems[i] > max)
-        max = pins->elems[x]->elems[i];
+    PinId* p = pins(x);
+    for (uint32_t i = 0; i < fanOut(x); i++) {
+      if (p[i] > max) max = p[i];
     }
     return max;
   }
 
   // Determine fan-in of given node
   uint32_t fanIn(NodeId id) {
-    return incoming->elems[id]->numElems;
+    if (frozen) return inOffsets[id+1] - inOffsets[id];
+    return inCount->elems[id];
   }
 
   // Determine fan-out of given node
   uint32_t fanOut(NodeId id) {
-    return outgoing->elems[id]->numElems;
+    if (frozen) return outOffsets[id+1] - outOffsets[id];
+    return outCount->elems[id];
   }
 
 };
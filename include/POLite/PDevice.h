@@ -35,6 +35,17 @@
 //   POLITE_DUMP_STATS - dump performance stats on termination
 //   POLITE_COUNT_MSGS - include message counts in performance stats
 
+// Macro for combining results on termination:
+//   POLITE_REDUCE - rather than each device sending the result of its
+//     finish handler to the host, combine the results on-device using
+//     the device type's static reduce handler, and send a single message
+//     to the host
+
+// Macro for mirroring high fan-in devices (see PGraph::mirrorHubs()):
+//   POLITE_MIRROR - messages arriving at a mirror are combined using the
+//     device's combine handler, and the partial result is forwarded to
+//     the mirrored device when the thread has nothing else to send
+
 // Thread-local device id
 typedef uint16_t PLocalDeviceId;
 
@@ -65,6 +76,9 @@ inline uint32_t maxLocalDeviceId() { return 8192; }
 typedef uint16_t Key;
 #define InvalidKey 0xffff
 
+// Parent of the root of the reduction tree
+#define PReduceHost 0xffffffff
+
 // Pins
 //   No      - means 'not ready to send'
 //   HostPin - means 'send to host'
@@ -95,6 +109,11 @@ template <typename S, typename E, typename M> struct PDevice {
   void recv(M* msg, E* edge);
   bool step();
   bool finish(volatile M* msg);
+  // Combine msg into acc (only used when POLITE_REDUCE is defined)
+  // (Static: threads with no devices take part in the reduction too)
+  static void reduce(M* acc, M* msg);
+  // Combine msg into acc (only used when POLITE_MIRROR is defined)
+  void combine(M* acc, M* msg);
 };
 
 // Generic device state structure
@@ -113,6 +132,11 @@ template <typename S> struct ALIGNED PState {
   // Ready-to-send status
   PPin readyToSend;
   int8_t isMarkedRTS;
+  #ifdef POLITE_MIRROR
+  // For mirrors, one plus index into thread's mirror accumulators;
+  // zero for all other devices
+  uint16_t mirror;
+  #endif
   // Custom state
   S state;
 };
@@ -186,6 +210,20 @@ template <typename DeviceType,
   PTR(PLocalDeviceId) senders;
   // This array is accessed in a LIFO manner
   PTR(PLocalDeviceId) sendersTop;
+  // Parent thread in reduction tree (or PReduceHost)
+  uint32_t reduceParent;
+  // Number of children in reduction tree
+  uint32_t reduceChildren;
+
+  #ifdef POLITE_MIRROR
+  // Partial results of the mirrors on this thread
+  // (destKey is non-zero if the accumulator holds a result)
+  PTR(PMessage<M>) mirrorAccs;
+  // Mirrors with a partial result waiting to be forwarded
+  PTR(PLocalDeviceId) mirrorsPending;
+  // This array is accessed in a LIFO manner
+  PTR(PLocalDeviceId) mirrorsPendingTop;
+  #endif
 
   // Count number of messages sent
   #ifdef POLITE_COUNT_MSGS
@@ -218,6 +256,15 @@ template <typename DeviceType,
     }
   }
 
+  // Is given device a mirror? (see PGraph::mirrorHubs())
+  INLINE bool isMirror(uint32_t id) {
+    #ifdef POLITE_MIRROR
+    return devices[id].mirror != 0;
+    #else
+    return false;
+    #endif
+  }
+
   // Helper function to construct a device
   INLINE DeviceType getDevice(uint32_t id) {
     DeviceType dev;
@@ -261,6 +308,43 @@ template <typename DeviceType,
     #endif
   }
 
+  // Invoke finish handler for each device, and combine the results with
+  // those of the child threads in the reduction tree before passing them
+  // to the parent.  The destKey field of the message is non-zero if the
+  // message holds a result, i.e. if any finish handler returned true.
+  void reduceFinish() {
+    PMessage<M>* acc = (PMessage<M>*) tinselSendSlot();
+    PMessage<M> tmp;
+    acc->destKey = 0;
+    // Results of devices on this thread
+    for (uint32_t i = 0; i < numDevices; i++) {
+      if (isMirror(i)) continue;
+      DeviceType dev = getDevice(i);
+      if (acc->destKey == 0)
+        acc->destKey = dev.finish(&acc->payload) ? 1 : 0;
+      else if (dev.finish(&tmp.payload))
+        DeviceType::reduce(&acc->payload, &tmp.payload);
+    }
+    // Results of child threads
+    for (uint32_t i = 0; i < reduceChildren; i++) {
+      tinselWaitUntil(TINSEL_CAN_RECV);
+      PMessage<M>* in = (PMessage<M>*) tinselRecv();
+      if (in->destKey != 0) {
+        if (acc->destKey == 0) {
+          acc->payload = in->payload;
+          acc->destKey = 1;
+        }
+        else
+          DeviceType::reduce(&acc->payload, &in->payload);
+      }
+      tinselFree(in);
+    }
+    // Pass to parent
+    tinselWaitUntil(TINSEL_CAN_SEND);
+    tinselSend(reduceParent == PReduceHost ?
+      tinselHostId() : reduceParent, acc);
+  }
+
   // Invoke device handlers
   void run() {
     // Current out-going edge in multicast
@@ -280,13 +364,30 @@ template <typename DeviceType,
     // Reset performance counters
     tinselPerfCountReset();
 
+    // Reset time step and message counts
+    // (Needed when the thread is restarted, see PGraph::restart())
+    time = 0;
+    #ifdef POLITE_COUNT_MSGS
+    msgsSent = msgsReceived = blockedSends = 0;
+    #endif
+
     // Initialisation
     sendersTop = senders;
+    #ifdef POLITE_MIRROR
+    mirrorsPendingTop = mirrorsPending;
+    #endif
     for (uint32_t i = 0; i < numDevices; i++) {
+      devices[i].isMarkedRTS=false;
+      #ifdef POLITE_MIRROR
+      // Mirrors have no handlers of their own
+      if (isMirror(i)) {
+        mirrorAccs[devices[i].mirror-1].destKey = 0;
+        continue;
+      }
+      #endif
       DeviceType dev = getDevice(i);
       // Invoke the initialiser for each device
       dev.init();
-      devices[i].isMarkedRTS=false;
       // Device ready to send?
       if (*dev.readyToSend != No) {
         senders_queue_add(i);
@@ -356,6 +457,25 @@ template <typename DeviceType,
           tinselWaitUntil(TINSEL_CAN_SEND|TINSEL_CAN_RECV);
         }
       }
+      #ifdef POLITE_MIRROR
+      else if (mirrorsPendingTop != mirrorsPending) {
+        if (tinselCanSend()) {
+          // Forward partial result of a mirror to the mirrored device
+          PLocalDeviceId src = *(--mirrorsPendingTop);
+          PMessage<M>* acc = &mirrorAccs[devices[src].mirror-1];
+          PMessage<M>* m = (PMessage<M>*) tinselSendSlot();
+          m->payload = acc->payload;
+          acc->destKey = 0;
+          outEdge = (POutEdge*) &outTableBase[devices[src].pinBase[0]];
+        }
+        else {
+          #ifdef POLITE_COUNT_MSGS
+          blockedSends++;
+          #endif
+          tinselWaitUntil(TINSEL_CAN_SEND|TINSEL_CAN_RECV);
+        }
+      }
+      #endif
       else {
         // Idle detection
         int idle = tinselIdle(!active);
@@ -364,6 +484,7 @@ template <typename DeviceType,
         else if (idle) {
           active = false;
           for (uint32_t i = 0; i < numDevices; i++) {
+            if (isMirror(i)) continue;
             DeviceType dev = getDevice(i);
             // Invoke the step handler for each device
             active = dev.step() || active;
@@ -390,11 +511,27 @@ template <typename DeviceType,
           // Lookup destination device
           PLocalDeviceId id = inEdge->devId;
           DeviceType dev = getDevice(id);
-          // Invoke receive handler
-          dev.recv(&inMsg->payload, &inEdge->edge);
-          // Insert device into a senders array, if not already there
-          if (*dev.readyToSend != No) {
-            senders_queue_add(id);
+          #ifdef POLITE_MIRROR
+          if (isMirror(id)) {
+            // Combine message into mirror's partial result
+            PMessage<M>* acc = &mirrorAccs[devices[id].mirror-1];
+            if (acc->destKey == 0) {
+              acc->payload = inMsg->payload;
+              acc->destKey = 1;
+              *(mirrorsPendingTop++) = id;
+            }
+            else
+              dev.combine(&acc->payload, &inMsg->payload);
+          }
+          else
+          #endif
+          {
+            // Invoke receive handler
+            dev.recv(&inMsg->payload, &inEdge->edge);
+            // Insert device into a senders array, if not already there
+            if (*dev.readyToSend != No) {
+              senders_queue_add(id);
+            }
           }
           inEdge++;
           #ifdef POLITE_COUNT_MSGS
@@ -410,16 +547,34 @@ template <typename DeviceType,
       dumpStats();
     #endif
 
+    #ifdef POLITE_REDUCE
+    reduceFinish();
+    #else
     // Invoke finish handler for each device
     for (uint32_t i = 0; i < numDevices; i++) {
+      if (isMirror(i)) continue;
       DeviceType dev = getDevice(i);
       tinselWaitUntil(TINSEL_CAN_SEND);
       PMessage<M>* m = (PMessage<M>*) tinselSendSlot();
       if (dev.finish(&m->payload)) tinselSend(tinselHostId(), m);
     }
+    #endif
+
+    // Sleep until the host requests a restart (see PGraph::stop())
+    tinselWaitUntil(TINSEL_CAN_RECV);
+    tinselFree(tinselRecv());
+
+    // Write back this thread's cache lines, so that the host can read
+    // and overwrite device states via the boot loader, and wait until
+    // they have reached memory by issuing a load from the vertex region
+    tinselCacheFlush();
+    if (numDevices > 0) {
+      volatile uint32_t* ptr = (uint32_t*) devices; ptr[0];
+    }
 
-    // Sleep
-    tinselWaitUntil(TINSEL_CAN_RECV); while (1);
+    // Acknowledge, then return to the boot loader
+    tinselWaitUntil(TINSEL_CAN_SEND);
+    tinselSend(tinselHostId(), tinselSendSlot());
   }
 
   #endif
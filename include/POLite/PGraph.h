@@ -4,8 +4,13 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <HostLink.h>
 #include <config.h>
 #include <POLite.h>
@@ -15,6 +20,7 @@
 #include <POLite/Bitmap.h>
 #include <POLite/ProgRouters.h>
 #include <type_traits>
+#include <unordered_map>
 #include <tinsel-interface.h>
 
 // Nodes of a POETS graph are devices
@@ -39,6 +45,22 @@ struct PEdgeDest {
   PDeviceAddr addr;
 };
 
+// This structure holds a run of edge destinations on the same mailbox
+// (Used by the parallel routing-table builder)
+struct PMailboxDests {
+  // Index of first destination in run
+  uint64_t first;
+  // Number of destinations in run
+  uint32_t numDests;
+  // Destination mailbox
+  uint32_t mbox;
+  // Local-multicast key and destination threads
+  // (Not valid until the input tables have been computed)
+  uint32_t key;
+  uint32_t threadMaskLow;
+  uint32_t threadMaskHigh;
+};
+
 // Comparison function for PEdgeDest
 // (Useful to sort destinations by thread id of destination)
 inline int cmpEdgeDest(const void* e0, const void* e1) {
@@ -47,6 +69,62 @@ inline int cmpEdgeDest(const void* e0, const void* e1) {
   return getThreadId(d0->addr) < getThreadId(d1->addr);
 }
 
+// Hash a block of memory, continuing from hash h
+// (Used to identify graphs in the mapping cache)
+inline uint64_t hashWords(uint64_t h, const uint8_t* p, uint64_t n) {
+  const uint64_t k = 0x87c37b91114253d5ull;
+  uint64_t i = 0;
+  for (; i <= n; i += 8) {
+    uint64_t w = 0;
+    memcpy(&w, &p[i], n-i < 8 ? n-i : 8);
+    w *= k;
+    w = (w << 31) | (w >> 33);
+    h ^= w;
+    h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+  }
+  h ^= n;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h;
+}
+
+// Hash a large block of memory, continuing from hash h,
+// using multiple host threads
+inline uint64_t hashBytes(uint64_t h, const void* data, uint64_t n) {
+  const uint8_t* p = (const uint8_t*) data;
+  const uint64_t chunkSize = 1 << 20;
+  uint64_t numChunks = (n + chunkSize - 1) / chunkSize;
+  if (numChunks <= 1) return hashWords(h, p, n);
+  uint64_t* chunkHash = new uint64_t [numChunks];
+  #pragma omp parallel for
+  for (uint64_t c = 0; c < numChunks; c++) {
+    uint64_t len = c == numChunks-1 ? n - c*chunkSize : chunkSize;
+    chunkHash[c] = hashWords(c, &p[c*chunkSize], len);
+  }
+  h = hashWords(h, (uint8_t*) chunkHash, numChunks * sizeof(uint64_t));
+  delete [] chunkHash;
+  return h;
+}
+
+// Environment variables that affect the result of the mapper
+// (Included in the key of the mapping cache)
+const char* const PMapperEnvVars[] = {
+  "POLITE_PLACER", "POLITE_ANNEAL_TIME"
+};
+
+// Per-thread memory regions, each mapped to SRAM or DRAM
+enum {
+  PVertexRegion, PInHeaderRegion, PInRestRegion, POutRegion, PNumRegions
+};
+const char* const PRegionNames[] = {
+  "vertices", "in-edge headers", "in-edge rest", "out-edges"
+};
+
+// Magic number and version of mapping cache files
+const uint32_t PMapCacheMagic = 0x4d4c4f50; // "POLM"
+const uint32_t PMapCacheVersion = 4;
+
 // POETS graph
 template <typename DeviceType,
           typename S, typename E, typename M> class PGraph {
@@ -85,10 +163,24 @@ template <typename DeviceType,
   Seq<PInEdge<E>>** inTableRest;
   // Bitmap denoting used space in header table, for each thread
   Bitmap** inTableBitmaps;
+  // Keys allocated on each mailbox, indexed by a hash of the receivers,
+  // so that identical receiver groups can share a key
+  // (Only valid while the routing tables are being computed)
+  std::unordered_multimap<uint64_t, uint32_t>* sharedInKeys;
+
+  // Number of times a key was shared rather than allocated, for the
+  // input tables and the programmable routers
+  uint64_t numSharedInKeys;
+  uint64_t numSharedRouterKeys;
 
   // Programmable routing tables
   ProgRouterMesh* progRouterTables;
 
+  // For each (device, pin) pair, the set of boards at which the
+  // multicast tree branches YX rather than XY (bit y*numBoardsX+x is
+  // set for board (x, y); NULL if XY routing is used throughout)
+  uint64_t* routeYX;
+
   // Receiver groups (used internally by some methods, but declared once
   // to avoid repeated allocation)
   PReceiverGroup<E> groups[TinselThreadsPerMailbox];
@@ -103,7 +195,15 @@ template <typename DeviceType,
     int ny = str ? atoi(str) : meshLenY;
     setNumBoards(nx, ny);
     numDevices = 0;
+    firstMirror = ~0u;
+    numMirrors = 0;
+    mirrorMaxFanIn = 0;
+    edgeLabelSeq = new Seq<E>;
+    edgeLabels = NULL;
+    deviceWeights = NULL;
+    messageRates = NULL;
     devices = NULL;
+    dirtyDevices = NULL;
     toDeviceAddr = NULL;
     numDevicesOnThread = NULL;
     fromDeviceAddr = NULL;
@@ -119,36 +219,97 @@ template <typename DeviceType,
     outEdgeMem = NULL;
     outEdgeMemSize = NULL;
     outEdgeMemBase = NULL;
+    partitionArena = NULL;
     mapVerticesToDRAM = false;
     mapInEdgeHeadersToDRAM = true;
     mapInEdgeRestToDRAM = true;
     mapOutEdgesToDRAM = true;
+    mapRegionsAutomatically = false;
     outTable = NULL;
     inTableHeaders = NULL;
     inTableRest = NULL;
     inTableBitmaps = NULL;
+    sharedInKeys = NULL;
     progRouterTables = NULL;
+    routeYX = NULL;
     chatty = 0;
     str = getenv("POLITE_CHATTY");
     if (str != NULL) {
       chatty = !strcmp(str, "0") ? 0 : 1;
     }
+    placerEffort = 8;
+    str = getenv("POLITE_PLACER_EFFORT");
+    if (str != NULL && atoi(str) > 0) placerEffort = atoi(str);
+    flatPlacement = false;
+    str = getenv("POLITE_FLAT_PLACEMENT");
+    if (str != NULL) {
+      flatPlacement = strcmp(str, "0") != 0;
+    }
+    localityOrder = false;
+    str = getenv("POLITE_LOCALITY_ORDER");
+    if (str != NULL) {
+      localityOrder = strcmp(str, "0") != 0;
+    }
+    parallelRouting = true;
+    str = getenv("POLITE_PARALLEL_ROUTING");
+    if (str != NULL) {
+      parallelRouting = strcmp(str, "0") != 0;
+    }
+    linkBalancing = false;
+    str = getenv("POLITE_LINK_BALANCING");
+    if (str != NULL) {
+      linkBalancing = strcmp(str, "0") != 0;
+    }
+    steinerRouting = false;
+    str = getenv("POLITE_STEINER_ROUTING");
+    if (str != NULL) {
+      steinerRouting = strcmp(str, "0") != 0;
+    }
+    verifyRouting = false;
+    str = getenv("POLITE_VERIFY_ROUTING");
+    if (str != NULL) {
+      verifyRouting = strcmp(str, "0") != 0;
+    }
+    stopped = false;
+    mapCacheDir = getenv("POLITE_MAP_CACHE");
+    if (mapCacheDir != NULL && *mapCacheDir == '\0') mapCacheDir = NULL;
   }
 
  public:
   // Number of devices
   uint32_t numDevices;
 
+  // Mirrors created by mirrorHubs() have ids from firstMirror onwards
+  PDeviceId firstMirror;
+  uint32_t numMirrors;
+  // Fan-in limit passed to mirrorHubs() (0 if not called)
+  uint32_t mirrorMaxFanIn;
+
   // Graph containing device ids and connections
   Graph graph;
 
-  // Edge labels: has same structure as graph.outgoing
-  Seq<Seq<E>*> edgeLabels;
+  // Edge labels, in the order edges were added
+  // (Released when the graph is frozen)
+  Seq<E>* edgeLabelSeq;
+
+  // Edge labels, with same structure as the graph's outgoing edges
+  // (Not valid until the graph is frozen)
+  E* edgeLabels;
+
+  // Weight of each device, and expected number of messages sent by
+  // each device, used by the placer to balance load between threads
+  // (NULL means unweighted; set using weightDevices() etc.)
+  Seq<uint32_t>* deviceWeights;
+  Seq<uint32_t>* messageRates;
 
   // Mapping from device id to device state
   // (Not valid until the mapper is called)
   PState<S>** devices;
 
+  // Which devices have had their state changed since it was last written
+  // (Set using markDirty(); not valid until the mapper is called)
+  bool* dirtyDevices;
+
   // Mapping from thread id to number of devices on that thread
   // (Not valid until the mapper is called)
   uint32_t* numDevicesOnThread;
@@ -173,6 +334,10 @@ template <typename DeviceType,
   uint32_t* outEdgeMemSize;
   uint32_t* outEdgeMemBase;
 
+  // Single allocation holding all of the above regions
+  // (Not valid until the mapper is called)
+  uint8_t* partitionArena;
+
   // Where to map the various regions
   // (If false, map to SRAM instead)
   bool mapVerticesToDRAM;
@@ -180,9 +345,51 @@ template <typename DeviceType,
   bool mapInEdgeRestToDRAM;
   bool mapOutEdgesToDRAM;
 
+  // Choose where to map the regions separately for each thread, placing
+  // the most frequently accessed bytes in SRAM while they fit
+  // (Overrides the above flags)
+  bool mapRegionsAutomatically;
+
   // Allow mapper to print useful information to stdout
   uint32_t chatty;
 
+  // Number of random starting points tried by the placer
+  uint32_t placerEffort;
+
+  // Partition straight to threads, rather than to boards, then
+  // mailboxes, then threads (see placeFlat())
+  bool flatPlacement;
+
+  // Order the devices on each thread to improve cache locality
+  // (see orderDevicesForLocality())
+  bool localityOrder;
+
+  // Use multiple host threads to construct the routing tables
+  // (The tables are the same either way)
+  bool parallelRouting;
+
+  // Choose between XY and YX routes to balance the load on inter-board
+  // links (see balanceLinkLoads())
+  // (Experimental: YX routes are not known to be free of deadlock)
+  bool linkBalancing;
+
+  // Use the multicast trees that cross the fewest inter-board links,
+  // choosing XY or YX branching at each board (see chooseRoutes())
+  // (Experimental, as for linkBalancing)
+  bool steinerRouting;
+
+  // Check the routing tables after constructing them
+  // (see verifyRoutingTables())
+  bool verifyRouting;
+
+  // Have the threads been returned to the boot loader by stop()?
+  bool stopped;
+
+  // Directory in which to cache the results of the mapper, or NULL
+  // (Mappings are keyed by a hash of the graph, board dimensions,
+  // and mapper settings, and reloaded rather than recomputed)
+  const char* mapCacheDir;
+
   // Setter for number of boards to use
   void setNumBoards(uint32_t x, uint32_t y) {
     if (x > meshLenX || y > meshLenY) {
@@ -196,7 +403,10 @@ template <typename DeviceType,
 
   // Create new device
   inline PDeviceId newDevice() {
-    edgeLabels.append(new SmallSeq<E>);
+    if (numMirrors > 0) {
+      printf("newDevice: can't add devices after mirrorHubs()\n");
+      exit(EXIT_FAILURE);
+    }
     numDevices++;
     return graph.newNode();
   }
@@ -207,25 +417,316 @@ template <typename DeviceType,
       printf("addEdge: pin exceeds POLITE_NUM_PINS\n");
       exit(EXIT_FAILURE);
     }
-    graph.addEdge(from, pin, to);
-    E edge;
-    edgeLabels.elems[from]->append(edge);
+    addLabelledEdge(E(), from, pin, to);
   }
 
   // Add labelled edge using given output pin
   void addLabelledEdge(E edge, PDeviceId x, PinId pin, PDeviceId y) {
     graph.addEdge(x, pin, y);
-    edgeLabels.elems[x]->append(edge);
+    if (! std::is_same<E, None>::value) {
+      graph.extendSeq(edgeLabelSeq, 1);
+      edgeLabelSeq->elems[edgeLabelSeq->numElems-1] = edge;
+    }
   }
 
-  // Allocate SRAM and DRAM partitions
-  void allocatePartitions() {
-    // Decide a maximum partition size that is reasonable
-    // SRAM: Partition size minus 2048 bytes for the stack
-    uint32_t maxSRAMSize = (1<<TinselLogBytesPerSRAMPartition) - 2048;
-    // DRAM: Partition size minus 65536 bytes for the stack
-    uint32_t maxDRAMSize = (1<<TinselLogBytesPerDRAMPartition) - 65536;
-    // Allocate partition sizes and bases
+  // Create given number of new devices
+  // Returns id of first new device
+  PDeviceId newDevices(uint32_t n) {
+    if (numMirrors > 0) {
+      printf("newDevices: can't add devices after mirrorHubs()\n");
+      exit(EXIT_FAILURE);
+    }
+    numDevices += n;
+    return graph.newNodes(n);
+  }
+
+  // Add edges in bulk, equivalent to calling
+  // addLabelledEdge(labels[i], srcs[i], pins[i], dsts[i]) for each i
+  // (If pins is NULL, pin 0 is used; if labels is NULL, edges are
+  // added as though by addEdge)
+  void addEdges(uint64_t n, const PDeviceId* srcs, const PinId* pins,
+                  const PDeviceId* dsts, const E* labels = NULL) {
+    if (pins != NULL) {
+      uint64_t bad = 0;
+      #pragma omp parallel for reduction(+:bad)
+      for (uint64_t i = 0; i < n; i++)
+        bad += pins[i] < 0 || pins[i] >= POLITE_NUM_PINS;
+      if (bad > 0) {
+        printf("addEdges: pin exceeds POLITE_NUM_PINS\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    graph.addEdges(n, srcs, pins, dsts);
+    if (! std::is_same<E, None>::value) {
+      uint64_t base = edgeLabelSeq->numElems;
+      graph.extendSeq(edgeLabelSeq, n);
+      #pragma omp parallel for
+      for (uint64_t i = 0; i < n; i++)
+        edgeLabelSeq->elems[base+i] = labels != NULL ? labels[i] : E();
+    }
+  }
+
+  // Add edges in bulk from a binary file, which is memory-mapped
+  // rather than parsed.  The file contains a uint64_t edge count n,
+  // followed by arrays of n source device ids (uint32_t), n pin ids
+  // (int32_t), n destination device ids (uint32_t) and, for labelled
+  // graphs, n edge labels (sizeof(E) bytes each).  The labels start
+  // at the first offset after the destination ids that is a multiple
+  // of alignof(E), with zero padding in between
+  void addEdgesFromFile(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+      printf("addEdgesFromFile: can't open '%s'\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    fstat(fd, &st);
+    uint64_t size = st.st_size;
+    uint8_t* base = NULL;
+    if (size > 0) {
+      base = (uint8_t*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (base == MAP_FAILED) {
+        printf("addEdgesFromFile: can't map '%s'\n", filename);
+        exit(EXIT_FAILURE);
+      }
+    }
+    close(fd);
+    uint64_t n = 0;
+    if (size >= sizeof(uint64_t)) memcpy(&n, base, sizeof(uint64_t));
+    uint64_t labelSize = std::is_same<E, None>::value ? 0 : sizeof(E);
+    uint64_t labelAlign = std::is_same<E, None>::value ? 1 : alignof(E);
+    // Check n against the size before multiplying, to avoid overflow
+    bool ok = size >= sizeof(uint64_t) &&
+                n <= (size - sizeof(uint64_t)) / (12 + labelSize);
+    uint64_t labelOffset = 0;
+    if (ok) {
+      labelOffset = sizeof(uint64_t) + n * 12;
+      labelOffset = (labelOffset + labelAlign - 1) / labelAlign * labelAlign;
+      ok = size == labelOffset + n * labelSize;
+    }
+    if (! ok) {
+      printf("addEdgesFromFile: '%s' has unexpected size\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    uint8_t* ptr = base + sizeof(uint64_t);
+    PDeviceId* srcs = (PDeviceId*) ptr; ptr += n * sizeof(PDeviceId);
+    PinId* pins = (PinId*) ptr; ptr += n * sizeof(PinId);
+    PDeviceId* dsts = (PDeviceId*) ptr;
+    E* labels = labelSize == 0 ? NULL : (E*) (base + labelOffset);
+    addEdges(n, srcs, pins, dsts, labels);
+    munmap(base, size);
+  }
+
+  // Is given device a mirror created by mirrorHubs()?
+  inline bool isMirror(PDeviceId id) { return id >= firstMirror; }
+
+  // Split the incoming edges of each device with fan-in greater than
+  // maxFanIn between new mirror devices, in chunks of at most maxFanIn
+  // edges, in the order the edges were added.  Each mirror combines the
+  // messages it receives using the device's combine handler and sends
+  // the partial result to the mirrored device on pin 0.  This is only
+  // valid if receiving combine(a, b) has the same effect as receiving a
+  // then b.  Requires POLITE_MIRROR and unlabelled edges.  Call once all
+  // devices and edges have been added, and before weighting devices.
+  // Mirrors have no handlers of their own, and are given ids following
+  // those of the existing devices.  Returns the number of mirrors.
+  uint32_t mirrorHubs(uint32_t maxFanIn) {
+    #ifndef POLITE_MIRROR
+    printf("mirrorHubs: requires POLITE_MIRROR\n");
+    exit(EXIT_FAILURE);
+    #endif
+    if (! std::is_same<E, None>::value) {
+      printf("mirrorHubs: requires unlabelled edges\n");
+      exit(EXIT_FAILURE);
+    }
+    if (graph.frozen || numMirrors > 0 || deviceWeights || messageRates) {
+      printf("mirrorHubs: must be called once, before mapping "
+             "or weighting devices\n");
+      exit(EXIT_FAILURE);
+    }
+    if (maxFanIn < 2) {
+      printf("mirrorHubs: maxFanIn must be at least 2\n");
+      exit(EXIT_FAILURE);
+    }
+    // Assign a range of mirror ids to each hub
+    uint32_t n = numDevices;
+    uint32_t* in = graph.inCount->elems;
+    PDeviceId* firstOf = new PDeviceId [n];
+    uint64_t count = 0;
+    for (PDeviceId d = 0; d < n; d++) {
+      firstOf[d] = n + count;
+      if (in[d] > maxFanIn) count += (in[d] + maxFanIn - 1) / maxFanIn;
+    }
+    if (count == 0) {
+      delete [] firstOf;
+      return 0;
+    }
+    if (n + count > 0x7fffffff) {
+      printf("mirrorHubs: too many devices\n");
+      exit(EXIT_FAILURE);
+    }
+    newDevices(count);
+    in = graph.inCount->elems;
+    // Redirect incoming edges of each hub to its mirrors
+    uint32_t* seen = (uint32_t*) calloc(n, sizeof(uint32_t));
+    PDeviceId* dsts = graph.edgeDsts->elems;
+    for (uint64_t e = 0; e < graph.numEdges; e++) {
+      PDeviceId d = dsts[e];
+      if (d < n && in[d] > maxFanIn) {
+        PDeviceId m = firstOf[d] + seen[d]++ / maxFanIn;
+        dsts[e] = m;
+        in[m]++;
+      }
+    }
+    // Connect each mirror to its hub
+    for (PDeviceId d = 0; d < n; d++) {
+      if (in[d] > maxFanIn) {
+        uint32_t k = (in[d] + maxFanIn - 1) / maxFanIn;
+        in[d] = 0;
+        for (uint32_t i = 0; i < k; i++) graph.addEdge(firstOf[d] + i, 0, d);
+      }
+    }
+    free(seen);
+    delete [] firstOf;
+    firstMirror = n;
+    numMirrors = count;
+    mirrorMaxFanIn = maxFanIn;
+    return count;
+  }
+
+  // Convert graph to CSR form (no more devices or edges can be added)
+  void freeze() {
+    if (graph.frozen) return;
+    if (! std::is_same<E, None>::value)
+      edgeLabels = graph.toCSROrder(edgeLabelSeq->elems);
+    delete edgeLabelSeq;
+    edgeLabelSeq = NULL;
+    graph.freeze();
+  }
+
+  // Set weight of each device using given function of device id
+  // (Call once all devices and edges have been added)
+  template <typename F> void weightDevices(F weight) {
+    setPerDevice(&deviceWeights, weight);
+  }
+
+  // Weight each device by its fan-in, i.e. its number of receives
+  void weightDevicesByFanIn() {
+    weightDevices([&](PDeviceId id) { return 1 + graph.fanIn(id); });
+  }
+
+  // Weight each device by its fan-out
+  void weightDevicesByFanOut() {
+    weightDevices([&](PDeviceId id) { return 1 + graph.fanOut(id); });
+  }
+
+  // Weight each device by the load it generated in a previous run, as
+  // recorded in a stats file written by politeSaveStats() using the
+  // current mapping.  The load of each thread (messages sent plus
+  // received, if POLITE_COUNT_MSGS was defined) or else of each core
+  // (busy cycles) is shared between its devices in proportion to their
+  // existing weights, so that repeatedly running, reweighting, and
+  // remapping converges towards balanced load.
+  void weightDevicesFromStats(const char* filename) {
+    if (numDevicesOnThread == NULL) {
+      printf("weightDevicesFromStats: graph has not been mapped\n");
+      exit(EXIT_FAILURE);
+    }
+    FILE* fp = fopen(filename, "rt");
+    if (fp == NULL) {
+      printf("weightDevicesFromStats: can't open '%s'\n", filename);
+      exit(EXIT_FAILURE);
+    }
+    // Load of each thread, and of each core
+    const uint32_t numCores = TinselMaxThreads >> TinselLogThreadsPerCore;
+    double* threadLoad = (double*) calloc(TinselMaxThreads, sizeof(double));
+    double* coreLoad = (double*) calloc(numCores, sizeof(double));
+    bool haveMsgCounts = false;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+      uint32_t x, y, c, t, ms, mr, pr, pri, bl, c1, c0, i1, i0;
+      int n;
+      if (sscanf(line, "%u:%u:%u:%u: %n", &x, &y, &c, &t, &n) < 4) continue;
+      if (x >= (1<<TinselMeshXBits) || y >= (1<<TinselMeshYBits) ||
+          c >= TinselCoresPerBoard || t >= TinselThreadsPerCore) continue;
+      uint32_t core = (y << TinselMeshXBits) | x;
+      core = (core << TinselLogCoresPerBoard) | c;
+      uint32_t threadId = (core << TinselLogThreadsPerCore) | t;
+      if (sscanf(line + n, "MS:%x,MR:%x,PR:%x,PRI:%x,BL:%x",
+            &ms, &mr, &pr, &pri, &bl) == 5) {
+        threadLoad[threadId] += (double) ms + (double) mr;
+        haveMsgCounts = true;
+      }
+      else if (sscanf(line + n, "C:%x %x,I:%x %x",
+                 &c1, &c0, &i1, &i0) == 4) {
+        uint64_t cycles = ((uint64_t) c1 << 32) | c0;
+        uint64_t idle = ((uint64_t) i1 << 32) | i0;
+        coreLoad[core] += cycles > idle ? (double) (cycles - idle) : 0;
+      }
+    }
+    fclose(fp);
+    // Existing weight of each device
+    double* weight = new double [numDevices];
+    for (PDeviceId id = 0; id < numDevices; id++)
+      weight[id] = deviceWeights == NULL || id >= deviceWeights->numElems ?
+                     1 : deviceWeights->elems[id];
+    // Share the load of each thread (or core) between its devices
+    double* load = new double [numDevices];
+    uint32_t logUnit = haveMsgCounts ? 0 : TinselLogThreadsPerCore;
+    for (uint32_t u = 0; u < (TinselMaxThreads >> logUnit); u++) {
+      double total = 0;
+      for (uint32_t t = u << logUnit; t < (u+1) << logUnit; t++)
+        for (uint32_t d = 0; d < numDevicesOnThread[t]; d++)
+          total += weight[fromDeviceAddr[t][d]];
+      double unitLoad = haveMsgCounts ? threadLoad[u] : coreLoad[u];
+      for (uint32_t t = u << logUnit; t < (u+1) << logUnit; t++)
+        for (uint32_t d = 0; d < numDevicesOnThread[t]; d++) {
+          PDeviceId id = fromDeviceAddr[t][d];
+          load[id] = total > 0 ? unitLoad * weight[id] / total : 0;
+        }
+    }
+    // Scale so that the average weight is 100
+    double sum = 0;
+    for (PDeviceId id = 0; id < numDevices; id++) sum += load[id];
+    double scale = sum > 0 ? 100.0 * numDevices / sum : 0;
+    weightDevices([&](PDeviceId id) {
+      uint32_t w = (uint32_t) (load[id] * scale + 0.5);
+      return sum > 0 ? (w == 0 ? 1 : w) : 100;
+    });
+    delete [] weight;
+    delete [] load;
+    free(threadLoad);
+    free(coreLoad);
+  }
+
+  // Set expected number of messages sent by each device, on each of its
+  // edges, using given function of device id
+  // (Call once all devices and edges have been added)
+  template <typename F> void setMessageRates(F rate) {
+    setPerDevice(&messageRates, rate);
+  }
+
+  // Fill per-device sequence using given function of device id
+  template <typename F> void setPerDevice(Seq<uint32_t>** seq, F f) {
+    if (*seq != NULL) delete *seq;
+    *seq = new Seq<uint32_t> (numDevices == 0 ? 1 : numDevices);
+    (*seq)->numElems = numDevices;
+    for (PDeviceId id = 0; id < numDevices; id++)
+      (*seq)->elems[id] = f(id);
+  }
+
+  // Per-device sequence as an array, checking it covers every device
+  const uint32_t* perDevice(Seq<uint32_t>* seq) {
+    if (seq == NULL) return NULL;
+    if ((uint32_t) seq->numElems != numDevices) {
+      printf("Mapper: device weights set before all devices were added\n");
+      exit(EXIT_FAILURE);
+    }
+    return seq->elems;
+  }
+
+  // Allocate arrays holding each thread's partitions, sizes, and bases
+  void allocatePartitionArrays() {
     vertexMem = (uint8_t**) calloc(TinselMaxThreads, sizeof(uint8_t*));
     vertexMemSize = (uint32_t*) calloc(TinselMaxThreads, sizeof(uint32_t));
     vertexMemBase = (uint32_t*) calloc(TinselMaxThreads, sizeof(uint32_t));
@@ -243,7 +744,203 @@ template <typename DeviceType,
     outEdgeMem = (uint8_t**) calloc(TinselMaxThreads, sizeof(uint8_t*));
     outEdgeMemSize = (uint32_t*) calloc(TinselMaxThreads, sizeof(uint32_t));
     outEdgeMemBase = (uint32_t*) calloc(TinselMaxThreads, sizeof(uint32_t));
+  }
+
+  // Allocate the initialised portion of every thread's partitions,
+  // given their sizes, from a single zeroed arena
+  void allocatePartitionArena() {
+    uint8_t** mem[] = { vertexMem, threadMem,
+      inEdgeHeaderMem, inEdgeRestMem, outEdgeMem };
+    uint32_t* size[] = { vertexMemSize, threadMemSize,
+      inEdgeHeaderMemSize, inEdgeRestMemSize, outEdgeMemSize };
+    // Keep each partition aligned for host-side access
+    const uint64_t hostAlign = 16;
+    uint64_t total = 0;
+    for (uint32_t r = 0; r < 5; r++)
+      for (uint32_t t = 0; t < TinselMaxThreads; t++)
+        total += (size[r][t] + hostAlign - 1) & ~(hostAlign - 1);
+    partitionArena = (uint8_t*) aligned_alloc(hostAlign,
+      total == 0 ? hostAlign : total);
+    if (partitionArena == NULL) {
+      printf("Error: unable to allocate %lu bytes for partitions\n",
+        (unsigned long) total);
+      exit(EXIT_FAILURE);
+    }
+    uint64_t offset = 0;
+    for (uint32_t r = 0; r < 5; r++)
+      for (uint32_t t = 0; t < TinselMaxThreads; t++) {
+        mem[r][t] = &partitionArena[offset];
+        offset += (size[r][t] + hostAlign - 1) & ~(hostAlign - 1);
+      }
+    // Clear arena in parallel
+    const uint64_t chunkSize = 1 << 20;
+    #pragma omp parallel for
+    for (uint64_t i = 0; i < total; i += chunkSize)
+      memset(&partitionArena[i], 0,
+        total - i < chunkSize ? total - i : chunkSize);
+  }
+
+  // Estimate the number of devices that fit on a thread, given the
+  // SRAM and DRAM partition sizes and the average fan-out
+  // (Used to limit partition sizes in the streaming placer)
+  uint64_t maxDevicesPerThread() {
+    uint64_t maxSRAMSize = (1<<TinselLogBytesPerSRAMPartition) - 2048;
+    uint64_t maxDRAMSize = (1<<TinselLogBytesPerDRAMPartition) - 65536;
+    maxSRAMSize -= cacheAlign(sizeof(PThread<DeviceType, S, E, M>));
+    uint64_t fanOut = numDevices == 0 ? 0 :
+      (graph.numEdges + numDevices - 1) / numDevices;
+    // Bytes per device in each region
+    uint64_t vertexSize = sizeof(PState<S>) + sizeof(PLocalDeviceId);
+    uint64_t headerSize = sizeof(PInHeader<E>);
+    uint64_t restSize = fanOut * sizeof(PInEdge<E>);
+    uint64_t outSize = fanOut * sizeof(POutEdge);
+    uint64_t sram = 0, dram = 0;
+    if (mapRegionsAutomatically) {
+      // Assume the worst case, where nothing fits in SRAM
+      dram = vertexSize + headerSize + restSize + outSize;
+    }
+    else {
+      if (mapVerticesToDRAM) dram += vertexSize; else sram += vertexSize;
+      if (mapInEdgeHeadersToDRAM) dram += headerSize; else sram += headerSize;
+      if (mapInEdgeRestToDRAM) dram += restSize; else sram += restSize;
+      if (mapOutEdgesToDRAM) dram += outSize; else sram += outSize;
+    }
+    uint64_t max = maxLocalDeviceId() - 1;
+    if (sram > 0 && maxSRAMSize / sram < max) max = maxSRAMSize / sram;
+    if (dram > 0 && maxDRAMSize / dram < max) max = maxDRAMSize / dram;
+    return max == 0 ? 1 : max;
+  }
+
+  // Number of mirrors on given thread
+  uint32_t numMirrorsOnThread(uint32_t threadId) {
+    uint32_t n = 0;
+    if (numMirrors > 0)
+      for (uint32_t i = 0; i < numDevicesOnThread[threadId]; i++)
+        n += isMirror(fromDeviceAddr[threadId][i]);
+    return n;
+  }
+
+  // Size of the (uninitialised) mirror accumulators and pending stack
+  // for given number of mirrors
+  uint32_t mirrorMemSize(uint32_t n) {
+    if (n == 0) return 0;
+    return wordAlign(sizeof(PMessage<M>) * n) +
+           wordAlign(sizeof(PLocalDeviceId) * n);
+  }
+
+  // Choose which of the given thread's regions to map to DRAM (returns
+  // a bit mask), filling the free SRAM with the regions having the most
+  // estimated accesses per byte.  Accesses are counted per message sent
+  // or received, assuming each device sends once; ties favour the
+  // region listed first.
+  uint8_t chooseRegions(uint32_t threadId, uint32_t* regionSize,
+                          uint32_t sramFree) {
+    const uint32_t lineBytes = 1 << TinselLogBytesPerLine;
+    uint64_t accesses[PNumRegions] = { 0 };
+    // Each device's state is accessed when it sends and receives
+    uint32_t numDevs = numDevicesOnThread[threadId];
+    accesses[PVertexRegion] = numDevs;
+    Seq<PInHeader<E>>* headers = inTableHeaders[threadId];
+    if (headers) {
+      for (int i = 0; i < headers->numElems; i++) {
+        uint32_t n = headers->elems[i].numReceivers;
+        accesses[PVertexRegion] += n;
+        // Each message reads its header, and the lines holding any
+        // receivers that don't fit in the header
+        accesses[PInHeaderRegion]++;
+        if (n > POLITE_EDGES_PER_HEADER) {
+          uint32_t bytes = (n - POLITE_EDGES_PER_HEADER) * sizeof(PInEdge<E>);
+          accesses[PInRestRegion] += (bytes + lineBytes - 1) / lineBytes;
+        }
+      }
+    }
+    // Each send reads the lines holding the out-edges of one pin
+    for (uint32_t devNum = 0; devNum < numDevs; devNum++) {
+      PDeviceId id = fromDeviceAddr[threadId][devNum];
+      for (uint32_t p = 0; p < POLITE_NUM_PINS; p++) {
+        uint32_t bytes = outTable[id][p]->numElems * sizeof(POutEdge);
+        accesses[POutRegion] += (bytes + lineBytes - 1) / lineBytes;
+      }
+    }
+    // Sort regions by decreasing accesses per byte
+    uint32_t order[PNumRegions];
+    for (uint32_t r = 0; r < PNumRegions; r++) order[r] = r;
+    std::stable_sort(order, order + PNumRegions, [&](uint32_t a, uint32_t b) {
+      return accesses[a] * regionSize[b] > accesses[b] * regionSize[a];
+    });
+    // Greedily fill SRAM
+    uint8_t inDRAM = 0;
+    for (uint32_t i = 0; i < PNumRegions; i++) {
+      uint32_t r = order[i];
+      if (regionSize[r] <= sramFree) sramFree -= regionSize[r];
+      else inDRAM |= 1 << r;
+    }
+    return inDRAM;
+  }
+
+  // Report the threads whose partitions are too big
+  void reportOverflow(uint8_t* overflow, uint8_t* regionsInDRAM,
+                        uint32_t maxSRAMSize, uint32_t maxDRAMSize) {
+    const uint32_t maxReported = 16;
+    uint32_t numOverflows = 0;
+    for (uint32_t threadId = 0; threadId < TinselMaxThreads; threadId++)
+      if (overflow[threadId]) numOverflows++;
+    printf("Error: partitions of %u thread(s) exceed the max size "
+           "(SRAM %u bytes, DRAM %u bytes)\n",
+           numOverflows, maxSRAMSize, maxDRAMSize);
+    uint32_t reported = 0;
+    for (uint32_t threadId = 0; threadId < TinselMaxThreads; threadId++) {
+      if (!overflow[threadId]) continue;
+      if (reported++ == maxReported) {
+        printf("  ... and %u more\n", numOverflows - maxReported);
+        break;
+      }
+      uint32_t numDevs = numDevicesOnThread[threadId];
+      uint32_t regionSize[PNumRegions] = {
+        vertexMemSize[threadId] +
+          mirrorMemSize(numMirrorsOnThread(threadId)) +
+            wordAlign(sizeof(PLocalDeviceId) * numDevs),
+        inEdgeHeaderMemSize[threadId], inEdgeRestMemSize[threadId],
+        outEdgeMemSize[threadId] };
+      uint32_t sram = threadMemSize[threadId], dram = 0;
+      for (uint32_t r = 0; r < PNumRegions; r++) {
+        if (regionsInDRAM[threadId] & (1 << r)) dram += regionSize[r];
+                                            else sram += regionSize[r];
+      }
+      printf("  Thread %u:%u:%u:%u (%u devices): SRAM %u bytes, "
+             "DRAM %u bytes, %s limit exceeded\n",
+        (threadId >> TinselLogThreadsPerBoard) &
+          ((1 << TinselMeshXBits) - 1),
+        threadId >> (TinselLogThreadsPerBoard + TinselMeshXBits),
+        (threadId >> TinselLogThreadsPerCore) & (TinselCoresPerBoard - 1),
+        threadId & (TinselThreadsPerCore - 1), numDevs, sram, dram,
+        overflow[threadId] == 1 ? "DRAM" : "SRAM");
+      for (uint32_t r = 0; r < PNumRegions; r++)
+        printf("    %s: %u bytes in %s\n", PRegionNames[r], regionSize[r],
+          regionsInDRAM[threadId] & (1 << r) ? "DRAM" : "SRAM");
+    }
+    if (!mapRegionsAutomatically)
+      printf("Consider setting mapRegionsAutomatically, ");
+    else
+      printf("Consider ");
+    printf("using more boards, or fewer devices\n");
+  }
+
+  // Allocate SRAM and DRAM partitions
+  void allocatePartitions() {
+    // Decide a maximum partition size that is reasonable
+    // SRAM: Partition size minus 2048 bytes for the stack
+    uint32_t maxSRAMSize = (1<<TinselLogBytesPerSRAMPartition) - 2048;
+    // DRAM: Partition size minus 65536 bytes for the stack
+    uint32_t maxDRAMSize = (1<<TinselLogBytesPerDRAMPartition) - 65536;
+    // Allocate partition sizes and bases
+    allocatePartitionArrays();
+    // Which threads' partitions are too big (1 = DRAM, 2 = SRAM)
+    uint8_t* overflow = (uint8_t*) calloc(TinselMaxThreads, 1);
+    // Which of each thread's regions are mapped to DRAM (bit mask)
+    uint8_t* regionsInDRAM = (uint8_t*) calloc(TinselMaxThreads, 1);
     // Compute partition sizes for each thread
+    #pragma omp parallel for schedule(dynamic, 64)
     for (uint32_t threadId = 0; threadId < TinselMaxThreads; threadId++) {
       // This variable is used to count the size of the *initialised*
       // partition.  The total partition size is larger as it includes
@@ -282,41 +979,41 @@ template <typename DeviceType,
       sizeEOMem = wordAlign(sizeEOMem);
       // The total partition size including uninitialised portions
       uint32_t totalSizeVMem =
-        sizeVMem + wordAlign(sizeof(PLocalDeviceId) * numDevs);
+        sizeVMem + mirrorMemSize(numMirrorsOnThread(threadId)) +
+          wordAlign(sizeof(PLocalDeviceId) * numDevs);
+      // Decide which regions to map to DRAM
+      uint32_t regionSize[PNumRegions] =
+        { totalSizeVMem, sizeEIHeaderMem, sizeEIRestMem, sizeEOMem };
+      uint8_t inDRAM = 0;
+      if (mapRegionsAutomatically)
+        inDRAM = chooseRegions(threadId, regionSize, maxSRAMSize - sizeTMem);
+      else {
+        if (mapVerticesToDRAM) inDRAM |= 1 << PVertexRegion;
+        if (mapInEdgeHeadersToDRAM) inDRAM |= 1 << PInHeaderRegion;
+        if (mapInEdgeRestToDRAM) inDRAM |= 1 << PInRestRegion;
+        if (mapOutEdgesToDRAM) inDRAM |= 1 << POutRegion;
+      }
+      regionsInDRAM[threadId] = inDRAM;
       // Check that total size is reasonable
       uint32_t totalSizeSRAM = sizeTMem;
       uint32_t totalSizeDRAM = 0;
-      if (mapVerticesToDRAM) totalSizeDRAM += totalSizeVMem;
-                        else totalSizeSRAM += totalSizeVMem;
-      if (mapInEdgeHeadersToDRAM) totalSizeDRAM += sizeEIHeaderMem;
-                             else totalSizeSRAM += sizeEIHeaderMem;
-      if (mapInEdgeRestToDRAM) totalSizeDRAM += sizeEIRestMem;
-                          else totalSizeSRAM += sizeEIRestMem;
-      if (mapOutEdgesToDRAM) totalSizeDRAM += sizeEOMem;
-                        else totalSizeSRAM += sizeEOMem;
-      if (totalSizeDRAM > maxDRAMSize) {
-        printf("Error: max DRAM partition size exceeded\n");
-        exit(EXIT_FAILURE);
-      }
-      if (totalSizeSRAM > maxSRAMSize) {
-        printf("Error: max SRAM partition size exceeded\n");
-        exit(EXIT_FAILURE);
+      for (uint32_t r = 0; r < PNumRegions; r++) {
+        if (inDRAM & (1 << r)) totalSizeDRAM += regionSize[r];
+                          else totalSizeSRAM += regionSize[r];
       }
-      // Allocate space for the initialised portion of the partition
+      if (totalSizeDRAM > maxDRAMSize) overflow[threadId] = 1;
+      else if (totalSizeSRAM > maxSRAMSize) overflow[threadId] = 2;
+      // Record size of the initialised portion of the partition
+      // (Space is allocated for all threads at once, below)
       assert((sizeVMem%4) == 0);
       assert((sizeTMem%4) == 0);
       assert((sizeEIHeaderMem%4) == 0);
       assert((sizeEIRestMem%4) == 0);
       assert((sizeEOMem%4) == 0);
-      vertexMem[threadId] = (uint8_t*) calloc(sizeVMem, 1);
       vertexMemSize[threadId] = sizeVMem;
-      threadMem[threadId] = (uint8_t*) calloc(sizeTMem, 1);
       threadMemSize[threadId] = sizeTMem;
-      inEdgeHeaderMem[threadId] = (uint8_t*) calloc(sizeEIHeaderMem, 1);
       inEdgeHeaderMemSize[threadId] = sizeEIHeaderMem;
-      inEdgeRestMem[threadId] = (uint8_t*) calloc(sizeEIRestMem, 1);
       inEdgeRestMemSize[threadId] = sizeEIRestMem;
-      outEdgeMem[threadId] = (uint8_t*) calloc(sizeEOMem, 1);
       outEdgeMemSize[threadId] = sizeEOMem;
       // Tinsel address of base of partition
       uint32_t partId = threadId & (TinselThreadsPerDRAM-1);
@@ -329,43 +1026,77 @@ template <typename DeviceType,
       threadMemBase[threadId] = sramBase;
       sramBase += threadMemSize[threadId];
       // Determine base addresses of each region
-      if (mapVerticesToDRAM) {
-        vertexMemBase[threadId] = dramBase;
-        dramBase += totalSizeVMem;
-      }
-      else {
-        vertexMemBase[threadId] = sramBase;
-        sramBase += totalSizeVMem;
-      }
-      if (mapInEdgeHeadersToDRAM) {
-        inEdgeHeaderMemBase[threadId] = dramBase;
-        dramBase += sizeEIHeaderMem;
-      }
-      else {
-        inEdgeHeaderMemBase[threadId] = sramBase;
-        sramBase += sizeEIHeaderMem;
-      }
-      if (mapInEdgeRestToDRAM) {
-        inEdgeRestMemBase[threadId] = dramBase;
-        dramBase += sizeEIRestMem;
-      }
-      else {
-        inEdgeRestMemBase[threadId] = sramBase;
-        sramBase += sizeEIRestMem;
-      }
-      if (mapOutEdgesToDRAM) {
-        outEdgeMemBase[threadId] = dramBase;
-        dramBase += sizeEOMem;
+      uint32_t* regionBase[PNumRegions] = { vertexMemBase,
+        inEdgeHeaderMemBase, inEdgeRestMemBase, outEdgeMemBase };
+      for (uint32_t r = 0; r < PNumRegions; r++) {
+        if (inDRAM & (1 << r)) {
+          regionBase[r][threadId] = dramBase;
+          dramBase += regionSize[r];
+        }
+        else {
+          regionBase[r][threadId] = sramBase;
+          sramBase += regionSize[r];
+        }
       }
-      else {
-        outEdgeMemBase[threadId] = sramBase;
-        sramBase += sizeEOMem;
+    }
+    // Check that partitions fit
+    for (uint32_t threadId = 0; threadId < TinselMaxThreads; threadId++) {
+      if (overflow[threadId]) {
+        reportOverflow(overflow, regionsInDRAM, maxSRAMSize, maxDRAMSize);
+        exit(EXIT_FAILURE);
       }
     }
+    // Summarise automatic choices, if chatty
+    if (chatty > 0 && mapRegionsAutomatically) {
+      uint32_t inSRAM[PNumRegions] = { 0 };
+      for (uint32_t threadId = 0; threadId < TinselMaxThreads; threadId++)
+        if (numDevicesOnThread[threadId] > 0)
+          for (uint32_t r = 0; r < PNumRegions; r++)
+            inSRAM[r] += !(regionsInDRAM[threadId] & (1 << r));
+      printf("POLite regions mapped to SRAM (number of threads):\n");
+      for (uint32_t r = 0; r < PNumRegions; r++)
+        printf("  %s: %u\n", PRegionNames[r], inSRAM[r]);
+    }
+    free(regionsInDRAM);
+    free(overflow);
+    // Allocate space for the initialised portion of every partition
+    allocatePartitionArena();
+  }
+
+  // The reduction tree (used when POLITE_REDUCE is defined) has the
+  // first thread of each mailbox as the parent of the mailbox's other
+  // threads, the first thread of each board as the parent of the
+  // board's other mailboxes, and thread 0 as the parent of the other
+  // boards.  Thread 0 passes the final result to the host.
+  uint32_t reduceParent(uint32_t threadId) {
+    const uint32_t mailboxMask = (1 << TinselLogThreadsPerMailbox) - 1;
+    const uint32_t boardMask = (1 << TinselLogThreadsPerBoard) - 1;
+    if (threadId & mailboxMask) return threadId & ~mailboxMask;
+    if (threadId & boardMask) return threadId & ~boardMask;
+    if (threadId != 0) return 0;
+    return PReduceHost;
+  }
+
+  // Number of children of given thread in the reduction tree
+  uint32_t reduceChildren(uint32_t threadId) {
+    const uint32_t mailboxMask = (1 << TinselLogThreadsPerMailbox) - 1;
+    const uint32_t boardMask = (1 << TinselLogThreadsPerBoard) - 1;
+    if (threadId & mailboxMask) return 0;
+    uint32_t n = mailboxMask;
+    if (threadId & boardMask) return n;
+    n += TinselMailboxesPerBoard - 1;
+    if (threadId != 0) return n;
+    return n + meshLenX * meshLenY - 1;
   }
 
   // Initialise partitions
+  // (Threads are independent, so are initialised in parallel)
   void initialisePartitions() {
+    // Does any thread's layout disagree with the pre-computed sizes?
+    uint32_t vertexMismatch = 0;
+    uint32_t outEdgeMismatch = 0;
+    #pragma omp parallel for schedule(dynamic, 64) \
+      reduction(+:vertexMismatch, outEdgeMismatch)
     for (uint32_t threadId = 0; threadId < TinselMaxThreads; threadId++) {
       // Next pointers for each partition
       uint32_t nextVMem = 0;
@@ -379,16 +1110,23 @@ template <typename DeviceType,
       thread->numVertices = numDevices;
       // Set tinsel address of array of device states
       thread->devices = vertexMemBase[threadId];
+      // Set position in reduction tree
+      thread->reduceParent = reduceParent(threadId);
+      thread->reduceChildren = reduceChildren(threadId);
       // Set tinsel address of base of edge tables
       thread->outTableBase = outEdgeMemBase[threadId];
       thread->inTableHeaderBase = inEdgeHeaderMemBase[threadId];
       thread->inTableRestBase = inEdgeRestMemBase[threadId];
       // Add space for each device on thread
       uint32_t numDevs = numDevicesOnThread[threadId];
+      uint32_t nextMirror = 0;
       for (uint32_t devNum = 0; devNum < numDevs; devNum++) {
         PState<S>* dev = (PState<S>*) &vertexMem[threadId][nextVMem];
         PDeviceId id = fromDeviceAddr[threadId][devNum];
         devices[id] = dev;
+        #ifdef POLITE_MIRROR
+        dev->mirror = isMirror(id) ? ++nextMirror : 0;
+        #endif
         // Add space for device
         nextVMem = nextVMem + sizeof(PState<S>);
       }
@@ -401,7 +1139,7 @@ template <typename DeviceType,
         for (uint32_t p = 0; p < POLITE_NUM_PINS; p++) {
           dev->pinBase[p] = nextOutIndex;
           Seq<POutEdge>* edges = outTable[id][p];
-          for (uint32_t i = 0; i < edges->numElems; i++) {
+          for (int i = 0; i < edges->numElems; i++) {
             outEdgeArray[nextOutIndex] = edges->elems[i];
             nextOutIndex++;
           }
@@ -412,32 +1150,43 @@ template <typename DeviceType,
         (PInHeader<E>*) inEdgeHeaderMem[threadId];
       Seq<PInHeader<E>>* headers = inTableHeaders[threadId];
       if (headers)
-        for (uint32_t i = 0; i < headers->numElems; i++) {
+        for (int i = 0; i < headers->numElems; i++) {
           inEdgeHeaderArray[i] = headers->elems[i];
         }
       PInEdge<E>* inEdgeRestArray = (PInEdge<E>*) inEdgeRestMem[threadId];
       Seq<PInEdge<E>>* edges = inTableRest[threadId];
       if (edges)
-        for (uint32_t i = 0; i < edges->numElems; i++) {
+        for (int i = 0; i < edges->numElems; i++) {
           inEdgeRestArray[i] = edges->elems[i];
         }
       // At this point, check that next pointers line up with heap sizes
-      if (nextVMem != vertexMemSize[threadId]) {
-        printf("Error: vertex mem size does not match pre-computed size\n");
-        exit(EXIT_FAILURE);
-      }
-      if ((nextOutIndex * sizeof(POutEdge)) != outEdgeMemSize[threadId]) {
-        printf("Error: out edge mem size does not match pre-computed size\n");
-        exit(EXIT_FAILURE);
-      }
-      // Set tinsel address of senders array
-      thread->senders = vertexMemBase[threadId] + nextVMem;
+      if (nextVMem != vertexMemSize[threadId])
+        vertexMismatch++;
+      if ((nextOutIndex * sizeof(POutEdge)) != outEdgeMemSize[threadId])
+        outEdgeMismatch++;
+      // Set tinsel addresses of mirror accumulators and senders array
+      uint32_t base = vertexMemBase[threadId] + nextVMem;
+      #ifdef POLITE_MIRROR
+      thread->mirrorAccs = base;
+      thread->mirrorsPending = base +
+        wordAlign(sizeof(PMessage<M>) * nextMirror);
+      #endif
+      thread->senders = base + mirrorMemSize(nextMirror);
+    }
+    if (vertexMismatch > 0) {
+      printf("Error: vertex mem size does not match pre-computed size\n");
+      exit(EXIT_FAILURE);
+    }
+    if (outEdgeMismatch > 0) {
+      printf("Error: out edge mem size does not match pre-computed size\n");
+      exit(EXIT_FAILURE);
     }
   }
 
   // Allocate mapping structures
   void allocateMapping() {
     devices = (PState<S>**) calloc(numDevices, sizeof(PState<S>*));
+    dirtyDevices = (bool*) calloc(numDevices, sizeof(bool));
     toDeviceAddr = (PDeviceAddr*) calloc(numDevices, sizeof(PDeviceAddr));
     fromDeviceAddr = (PDeviceId**) calloc(TinselMaxThreads, sizeof(PDeviceId*));
     numDevicesOnThread = (uint32_t*) calloc(TinselMaxThreads, sizeof(uint32_t));
@@ -481,7 +1230,7 @@ template <typename DeviceType,
 
   // Determine local-multicast routing key for given set of receivers
   // (The key must be the same for all receivers)
-  uint32_t findKey(uint32_t numGroups) { 
+  uint32_t findKey(PReceiverGroup<E>* groups, uint32_t numGroups) {
     // Fast path (single receiver)
     if (numGroups == 1) {
       Bitmap* bm = inTableBitmaps[groups[0].threadId];
@@ -517,10 +1266,58 @@ template <typename DeviceType,
     return 64*index + bit;
   }
 
-  // Add entries to the input tables for the given receivers
+  // Hash the given receiver groups
+  uint64_t hashReceivers(PReceiverGroup<E>* groups, uint32_t numGroups) {
+    uint64_t h = numGroups;
+    for (uint32_t i = 0; i < numGroups; i++) {
+      PReceiverGroup<E>* g = &groups[i];
+      h = hashWords(h, (uint8_t*) &g->threadId, sizeof(uint32_t));
+      h = hashWords(h, (uint8_t*) g->receivers.elems,
+            g->receivers.numElems * sizeof(PInEdge<E>));
+    }
+    return h;
+  }
+
+  // Do the input tables already map the given key to the given receivers?
+  bool hasInTableEntries(PReceiverGroup<E>* groups, uint32_t numGroups,
+                           uint32_t key) {
+    for (uint32_t i = 0; i < numGroups; i++) {
+      PReceiverGroup<E>* g = &groups[i];
+      uint32_t t = g->threadId;
+      uint32_t numEdges = g->receivers.numElems;
+      if (key >= (uint32_t) inTableHeaders[t]->numElems) return false;
+      PInHeader<E>* header = &inTableHeaders[t]->elems[key];
+      if (header->numReceivers != numEdges) return false;
+      uint32_t numHeaderEdges = numEdges < POLITE_EDGES_PER_HEADER ?
+        numEdges : POLITE_EDGES_PER_HEADER;
+      if (memcmp(header->edges, g->receivers.elems,
+            numHeaderEdges * sizeof(PInEdge<E>)) != 0) return false;
+      if (memcmp(&inTableRest[t]->elems[header->restIndex],
+            &g->receivers.elems[numHeaderEdges],
+              (numEdges - numHeaderEdges) * sizeof(PInEdge<E>)) != 0)
+        return false;
+    }
+    return true;
+  }
+
+  // Add entries to the input tables for the given receivers, reusing
+  // the key of an identical set of receivers if there is one
   // (Only valid after mapper is called)
-  uint32_t addInTableEntries(uint32_t numGroups) {
-    uint32_t key = findKey(numGroups);
+  uint32_t addInTableEntries(PReceiverGroup<E>* groups, uint32_t numGroups) {
+    std::unordered_multimap<uint64_t, uint32_t>* shared = NULL;
+    uint64_t h = 0;
+    if (sharedInKeys) {
+      uint32_t mbox = groups[0].threadId >> TinselLogThreadsPerMailbox;
+      shared = &sharedInKeys[mbox];
+      h = hashReceivers(groups, numGroups);
+      auto range = shared->equal_range(h);
+      for (auto it = range.first; it != range.second; it++)
+        if (hasInTableEntries(groups, numGroups, it->second)) {
+          __atomic_fetch_add(&numSharedInKeys, 1, __ATOMIC_RELAXED);
+          return it->second;
+        }
+    }
+    uint32_t key = findKey(groups, numGroups);
     if (key >= 0xffff) {
       printf("Routing key exceeds 16 bits\n");
       exit(EXIT_FAILURE);
@@ -533,10 +1330,13 @@ template <typename DeviceType,
       if (numEdges > 0) {
         // Determine thread id of receiver
         uint32_t t = g->threadId;
-        // Extend table
+        // Extend table (clearing unused headers)
         Seq<PInHeader<E>>* headers = inTableHeaders[t];
-        if (key >= headers->numElems)
-          headers->extendBy(key + 1 - headers->numElems);
+        if (key >= (uint32_t) headers->numElems) {
+          uint32_t n = headers->numElems;
+          headers->extendBy(key + 1 - n);
+          memset(&headers->elems[n], 0, (key + 1 - n) * sizeof(PInHeader<E>));
+        }
         // Fill in header
         PInHeader<E>* header = &inTableHeaders[t]->elems[key];
         header->numReceivers = numEdges;
@@ -559,6 +1359,7 @@ template <typename DeviceType,
         }
       }
     }
+    if (shared) shared->emplace(h, key);
     return key;
   }
 
@@ -572,13 +1373,14 @@ template <typename DeviceType,
     PDeviceAddr devAddr = toDeviceAddr[devId];
     uint32_t devBoard = getThreadId(devAddr) >> TinselLogThreadsPerBoard;
     // Split destinations into local/non-local
-    Seq<PDeviceId>* dests = graph.outgoing->elems[devId];
-    Seq<PinId>* pinIds = graph.pins->elems[devId];
-    for (uint32_t d = 0; d < dests->numElems; d++) {
-      if (pinIds->elems[d] == pinId) {
+    PDeviceId* dests = graph.outgoing(devId);
+    PinId* pinIds = graph.pins(devId);
+    uint32_t numDests = graph.fanOut(devId);
+    for (uint32_t d = 0; d < numDests; d++) {
+      if (pinIds[d] == pinId) {
         PEdgeDest e;
         e.index = d;
-        e.dest = dests->elems[d];
+        e.dest = dests[d];
         e.addr = toDeviceAddr[e.dest];
         uint32_t destBoard = getThreadId(e.addr) >> TinselLogThreadsPerBoard;
         if (devBoard == destBoard)
@@ -599,7 +1401,7 @@ template <typename DeviceType,
          Seq<PRoutingDest>* out) {
     out->clear();
     uint32_t index = 0;
-    while (index < dests->numElems) {
+    while (index < (uint32_t) dests->numElems) {
       // New set of receiver groups on same mailbox
       uint32_t threadMaskLow = 0;
       uint32_t threadMaskHigh = 0;
@@ -610,7 +1412,7 @@ template <typename DeviceType,
       uint32_t thread = getThreadId(dests->elems[index].addr) &
                           ((1<<TinselLogThreadsPerMailbox)-1);
       // Determine edges targetting same mailbox
-      while (index < dests->numElems) {
+      while (index < (uint32_t) dests->numElems) {
         PEdgeDest* edge = &dests->elems[index];
         // Determine destination mailbox address and mailbox-local thread
         uint32_t destMailbox = getThreadId(edge->addr) >>
@@ -621,11 +1423,12 @@ template <typename DeviceType,
         if (destMailbox == mbox) {
           if (destThread == thread) {
             // Add to current receiver group
+            // (Cleared so that receiver groups can be compared bytewise)
             PInEdge<E> in;
+            memset(&in, 0, sizeof(in));
             in.devId = getLocalDeviceId(edge->addr);
-            Seq<E>* edges = edgeLabels.elems[d];
             if (! std::is_same<E, None>::value)
-              in.edge = edges->elems[edge->index];
+              in.edge = edgeLabels[graph.outOffsets[d] + edge->index];
             // Update current receiver group
             groups[nextGroup].receivers.append(in);
             groups[nextGroup].threadId = getThreadId(edge->addr);
@@ -643,7 +1446,7 @@ template <typename DeviceType,
         else break;
       }
       // Add input table entries
-      uint32_t key = addInTableEntries(nextGroup+1);
+      uint32_t key = addInTableEntries(groups, nextGroup+1);
       // Add output entry
       PRoutingDest dest;
       dest.kind = PRDestKindMRM;
@@ -657,9 +1460,9 @@ template <typename DeviceType,
     }
   }
 
-  // Compute routing tables
+  // Compute routing tables, one device at a time
   // (Only valid after mapper is called)
-  void computeRoutingTables() {
+  void computeRoutingTablesSerial() {
     // Edge destinations (local to sender board, or not)
     Seq<PEdgeDest> local;
     Seq<PEdgeDest> nonLocal;
@@ -667,8 +1470,8 @@ template <typename DeviceType,
     // Routing destinations
     Seq<PRoutingDest> dests;
 
-    // Allocate per-board programmable routing tables
-    progRouterTables = new ProgRouterMesh(numBoardsX, numBoardsY);
+    // Keys of the destination sets routed from each board
+    ProgRouterKeyMemo* memos = new ProgRouterKeyMemo [numBoardsX*numBoardsY];
 
     // For each device
     for (uint32_t d = 0; d < numDevices; d++) {
@@ -678,7 +1481,7 @@ template <typename DeviceType,
         splitDests(d, p, &local, &nonLocal);
         // Deal with board-local connections
         computeTables(&local, d, &dests);
-        for (uint32_t i = 0; i < dests.numElems; i++) {
+        for (int i = 0; i < dests.numElems; i++) {
           PRoutingDest dest = dests.elems[i];
           POutEdge edge;
           edge.mbox = dest.mbox;
@@ -689,9 +1492,25 @@ template <typename DeviceType,
         }
         // Deal with non-board-local connections
         computeTables(&nonLocal, d, &dests);
+        for (int i = 0; i < dests.numElems; i++)
+          useUnicastRecord(&dests.elems[i]);
         uint32_t src = getThreadId(toDeviceAddr[d]) >>
           TinselLogThreadsPerMailbox;
-        uint32_t key = progRouterTables->addDestsFromBoard(src, &dests);
+        uint32_t key = 0;
+        if (dests.numElems > 0) {
+          // Reuse key of an identical destination set on the same board
+          ProgRouterKeyMemo* memo =
+            &memos[destY(src) * numBoardsX + destX(src)];
+          uint64_t yx = routeYX != NULL ? routeYX[d*POLITE_NUM_PINS + p] : 0;
+          bool added;
+          uint32_t set = memo->intern(&dests, &added, yx);
+          if (added)
+            memo->values.elems[set] =
+              progRouterTables->addDestsFromBoard(src, &dests, yx);
+          else
+            numSharedRouterKeys++;
+          key = memo->values.elems[set];
+        }
         POutEdge edge;
         edge.mbox = tinselUseRoutingKey();
         edge.key = 0;
@@ -700,43 +1519,760 @@ template <typename DeviceType,
         outTable[d][p]->append(edge);
         // Add output list terminator
         POutEdge term;
+        term.mbox = 0;
         term.key = InvalidKey;
+        term.threadMaskLow = 0;
+        term.threadMaskHigh = 0;
         outTable[d][p]->append(term);
       }
     }
+    delete [] memos;
+  }
+
+  // Split the destinations of each device into runs on the same mailbox
+  // (Used by the parallel routing-table builder.  Destinations for
+  // device d are stored from index destBase[d] onwards, grouped by
+  // pin, with local before non-local, and sorted as in splitDests().
+  // The runs for pin p of device d, on side s (0 = local, 1 = non-local)
+  // are stored from index runBase[(d*POLITE_NUM_PINS+p)*2+s] onwards,
+  // and there are numRuns[(d*POLITE_NUM_PINS+p)*2+s] of them.)
+  void computeMailboxRuns(uint64_t* destBase, PEdgeDest* allDests,
+         uint64_t* runBase, uint32_t* numRuns, PMailboxDests* runs) {
+    #pragma omp parallel
+    {
+      Seq<PEdgeDest> local;
+      Seq<PEdgeDest> nonLocal;
+      #pragma omp for schedule(dynamic, 256)
+      for (uint32_t d = 0; d < numDevices; d++) {
+        uint64_t nextDest = destBase[d];
+        uint64_t nextRun = destBase[d];
+        for (uint32_t p = 0; p < POLITE_NUM_PINS; p++) {
+          splitDests(d, p, &local, &nonLocal);
+          for (uint32_t s = 0; s < 2; s++) {
+            Seq<PEdgeDest>* dests = s == 0 ? &local : &nonLocal;
+            uint32_t r = (d*POLITE_NUM_PINS + p)*2 + s;
+            runBase[r] = nextRun;
+            numRuns[r] = 0;
+            for (int i = 0; i < dests->numElems; i++) {
+              PEdgeDest* edge = &dests->elems[i];
+              uint32_t mbox = getThreadId(edge->addr) >>
+                                TinselLogThreadsPerMailbox;
+              // Start a new run when the mailbox changes
+              if (i == 0 || mbox != runs[nextRun-1].mbox) {
+                PMailboxDests* run = &runs[nextRun++];
+                run->first = nextDest;
+                run->numDests = 0;
+                run->mbox = mbox;
+                numRuns[r]++;
+              }
+              runs[nextRun-1].numDests++;
+              allDests[nextDest++] = *edge;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Add input table entries for a run of destinations on the same mailbox,
+  // and determine the key and thread mask to use for the run
+  // (Mirrors computeTables(); the given receiver groups are used
+  // as temporary storage)
+  void addRunInTableEntries(uint32_t d, PEdgeDest* dests,
+         PMailboxDests* run, PReceiverGroup<E>* groups) {
+    uint32_t threadMaskLow = 0;
+    uint32_t threadMaskHigh = 0;
+    uint32_t nextGroup = 0;
+    uint32_t thread = getThreadId(dests[run->first].addr) &
+                        ((1<<TinselLogThreadsPerMailbox)-1);
+    for (uint32_t i = 0; i < run->numDests; i++) {
+      PEdgeDest* edge = &dests[run->first + i];
+      uint32_t destThread = getThreadId(edge->addr) &
+                              ((1<<TinselLogThreadsPerMailbox)-1);
+      // Start new receiver group when thread changes
+      if (destThread != thread) {
+        thread = destThread;
+        nextGroup++;
+        assert(nextGroup < TinselThreadsPerMailbox);
+      }
+      // Add to current receiver group
+      PInEdge<E> in;
+      memset(&in, 0, sizeof(in));
+      in.devId = getLocalDeviceId(edge->addr);
+      if (! std::is_same<E, None>::value)
+        in.edge = edgeLabels[graph.outOffsets[d] + edge->index];
+      groups[nextGroup].receivers.append(in);
+      groups[nextGroup].threadId = getThreadId(edge->addr);
+      if (thread < 32) threadMaskLow |= 1 << thread;
+      if (thread >= 32) threadMaskHigh |= 1 << (thread-32);
+    }
+    run->key = addInTableEntries(groups, nextGroup+1);
+    run->threadMaskLow = threadMaskLow;
+    run->threadMaskHigh = threadMaskHigh;
+    for (uint32_t i = 0; i <= nextGroup; i++) groups[i].receivers.clear();
+  }
+
+  // Use a URM1 record, which is half the size of an MRM record, for
+  // the given routing destination if it has a single receiving thread.
+  // A URM1 record writes its key over the first word of the message,
+  // rather than the first half-word, so is only used if the rest of
+  // that word is padding.
+  void useUnicastRecord(PRoutingDest* dest) {
+    if (offsetof(PMessage<M>, payload) < sizeof(uint32_t)) return;
+    if (dest->kind != PRDestKindMRM) return;
+    uint32_t low = dest->mrm.threadMaskLow;
+    uint32_t high = dest->mrm.threadMaskHigh;
+    if (__builtin_popcount(low) + __builtin_popcount(high) != 1) return;
+    uint32_t key = dest->mrm.key;
+    dest->kind = PRDestKindURM1;
+    dest->urm1.threadId = low ? __builtin_ctz(low) : 32+__builtin_ctz(high);
+    dest->urm1.key = key;
+  }
+
+  // Convert runs of destinations on the same mailbox to routing
+  // destinations (Used by the parallel routing-table builder)
+  void runsToRoutingDests(PMailboxDests* runs, uint32_t numRuns,
+                            Seq<PRoutingDest>* dests) {
+    dests->clear();
+    for (uint32_t i = 0; i < numRuns; i++) {
+      PRoutingDest dest;
+      dest.kind = PRDestKindMRM;
+      dest.mbox = runs[i].mbox;
+      dest.mrm.key = runs[i].key;
+      dest.mrm.threadMaskLow = runs[i].threadMaskLow;
+      dest.mrm.threadMaskHigh = runs[i].threadMaskHigh;
+      useUnicastRecord(&dest);
+      dests->append(dest);
+    }
+  }
+
+  // Compute routing tables using multiple host threads
+  // (Only valid after mapper is called)
+  // The resulting tables are identical to those produced by
+  // computeRoutingTablesSerial().  Work is divided into phases:
+  //   1. Destinations of each device are split and sorted (by device)
+  //   2. Input tables are filled, in device order (by receiving mailbox)
+  //   3. Senders sharing a destination set are found (by board)
+  //   4. Output tables are filled and ProgRouter jobs planned (by device)
+  //   5. ProgRouter jobs are executed, in device order (by board)
+  void computeRoutingTablesParallel() {
+    const uint32_t numPins = POLITE_NUM_PINS;
+    const uint32_t numMailboxes = TinselMaxThreads >>
+                                    TinselLogThreadsPerMailbox;
+    const uint32_t numBoards = numBoardsX * numBoardsY;
+
+    // Phase 1: split destinations into runs on the same mailbox
+    uint64_t* destBase = new uint64_t [numDevices+1];
+    destBase[0] = 0;
+    for (uint32_t d = 0; d < numDevices; d++)
+      destBase[d+1] = destBase[d] + graph.fanOut(d);
+    uint64_t numEdges = destBase[numDevices];
+    PEdgeDest* allDests = new PEdgeDest [numEdges];
+    PMailboxDests* runs = new PMailboxDests [numEdges];
+    uint64_t* runBase = new uint64_t [numDevices*numPins*2];
+    uint32_t* numRuns = new uint32_t [numDevices*numPins*2];
+    computeMailboxRuns(destBase, allDests, runBase, numRuns, runs);
+
+    // Phase 2: bucket the runs by receiving mailbox, preserving the order
+    // in which the serial builder would consider them, and fill the
+    // input tables of each mailbox in parallel
+    uint64_t* mboxBase = new uint64_t [numMailboxes+1];
+    for (uint32_t m = 0; m <= numMailboxes; m++) mboxBase[m] = 0;
+    for (uint64_t r = 0; r < numDevices*numPins*2; r++)
+      for (uint32_t i = 0; i < numRuns[r]; i++)
+        mboxBase[runs[runBase[r]+i].mbox+1]++;
+    for (uint32_t m = 0; m < numMailboxes; m++)
+      mboxBase[m+1] += mboxBase[m];
+    uint64_t* mboxRuns = new uint64_t [mboxBase[numMailboxes]];
+    uint32_t* runDevice = new uint32_t [mboxBase[numMailboxes]];
+    uint64_t* mboxNext = new uint64_t [numMailboxes];
+    for (uint32_t m = 0; m < numMailboxes; m++) mboxNext[m] = mboxBase[m];
+    for (uint64_t r = 0; r < numDevices*numPins*2; r++)
+      for (uint32_t i = 0; i < numRuns[r]; i++) {
+        uint64_t run = runBase[r]+i;
+        uint64_t slot = mboxNext[runs[run].mbox]++;
+        mboxRuns[slot] = run;
+        runDevice[slot] = r / (numPins*2);
+      }
+    delete [] mboxNext;
+    #pragma omp parallel
+    {
+      PReceiverGroup<E>* threadGroups =
+        new PReceiverGroup<E> [TinselThreadsPerMailbox];
+      #pragma omp for schedule(dynamic)
+      for (uint32_t m = 0; m < numMailboxes; m++)
+        for (uint64_t i = mboxBase[m]; i < mboxBase[m+1]; i++)
+          addRunInTableEntries(runDevice[i], allDests,
+            &runs[mboxRuns[i]], threadGroups);
+      delete [] threadGroups;
+    }
+    delete [] mboxBase;
+    delete [] mboxRuns;
+    delete [] runDevice;
+    delete [] allDests;
+
+    // Phase 3: find the (device, pin) pairs whose non-local destination
+    // set is identical to that of an earlier pair on the same board, and
+    // which can therefore use its routing key
+    uint32_t* keyOwner = new uint32_t [numDevices*numPins];
+    Seq<uint32_t>* boardDevices = new Seq<uint32_t> [numBoards];
+    for (uint32_t d = 0; d < numDevices; d++) {
+      uint32_t src = getThreadId(toDeviceAddr[d]) >>
+        TinselLogThreadsPerMailbox;
+      boardDevices[destY(src) * numBoardsX + destX(src)].append(d);
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for (uint32_t b = 0; b < numBoards; b++) {
+      ProgRouterKeyMemo memo;
+      Seq<PRoutingDest> dests;
+      for (int i = 0; i < boardDevices[b].numElems; i++) {
+        uint32_t d = boardDevices[b].elems[i];
+        for (uint32_t p = 0; p < numPins; p++) {
+          uint32_t dp = d*numPins + p;
+          keyOwner[dp] = dp;
+          runsToRoutingDests(&runs[runBase[dp*2+1]], numRuns[dp*2+1], &dests);
+          if (dests.numElems == 0) continue;
+          uint64_t yx = routeYX != NULL ? routeYX[dp] : 0;
+          bool added;
+          uint32_t set = memo.intern(&dests, &added, yx);
+          if (added)
+            memo.values.elems[set] = dp;
+          else {
+            keyOwner[dp] = memo.values.elems[set];
+            __atomic_fetch_add(&numSharedRouterKeys, 1, __ATOMIC_RELAXED);
+          }
+        }
+      }
+    }
+    delete [] boardDevices;
+
+    // Phase 4: fill the output tables and plan the ProgRouter jobs,
+    // using a separate plan for each host thread
+    uint32_t numPlans = omp_get_max_threads();
+    ProgRouterPlan* plans = new ProgRouterPlan [numPlans];
+    // Plan used by each device
+    uint32_t* devPlan = new uint32_t [numDevices];
+    // Range of jobs for each (device, pin) pair
+    // (The last job in the range is the one used by the sender)
+    uint32_t* firstJob = new uint32_t [numDevices*numPins];
+    int32_t* senderJob = new int32_t [numDevices*numPins];
+    #pragma omp parallel
+    {
+      uint32_t me = omp_get_thread_num();
+      ProgRouterPlan* plan = &plans[me];
+      Seq<PRoutingDest> dests;
+      #pragma omp for schedule(dynamic, 256)
+      for (uint32_t d = 0; d < numDevices; d++) {
+        devPlan[d] = me;
+        for (uint32_t p = 0; p < numPins; p++) {
+          uint32_t r = (d*numPins + p)*2;
+          // Deal with board-local connections
+          for (uint32_t i = 0; i < numRuns[r]; i++) {
+            PMailboxDests* run = &runs[runBase[r]+i];
+            POutEdge edge;
+            edge.mbox = run->mbox;
+            edge.key = run->key;
+            edge.threadMaskLow = run->threadMaskLow;
+            edge.threadMaskHigh = run->threadMaskHigh;
+            outTable[d][p]->append(edge);
+          }
+          // Deal with non-board-local connections
+          // (Unless the key of an earlier sender will be used)
+          uint32_t src = getThreadId(toDeviceAddr[d]) >>
+            TinselLogThreadsPerMailbox;
+          firstJob[d*numPins + p] = plan->jobs.numElems;
+          senderJob[d*numPins + p] = -1;
+          if (keyOwner[d*numPins + p] == d*numPins + p) {
+            runsToRoutingDests(&runs[runBase[r+1]], numRuns[r+1], &dests);
+            uint64_t yx = routeYX != NULL ? routeYX[d*numPins + p] : 0;
+            senderJob[d*numPins + p] =
+              progRouterTables->planDestsFromBoard(src, &dests, plan, yx);
+          }
+          // Key is filled in once the jobs have been executed
+          POutEdge edge;
+          edge.mbox = tinselUseRoutingKey();
+          edge.key = 0;
+          edge.threadMaskLow = 0;
+          edge.threadMaskHigh = 0;
+          outTable[d][p]->append(edge);
+          // Add output list terminator
+          POutEdge term;
+          term.mbox = 0;
+          term.key = InvalidKey;
+          term.threadMaskLow = 0;
+          term.threadMaskHigh = 0;
+          outTable[d][p]->append(term);
+        }
+      }
+    }
+    delete [] runs;
+    delete [] runBase;
+    delete [] numRuns;
+    delete [] destBase;
+
+    // Phase 5: bucket the jobs by board, preserving the order in which
+    // the serial builder would generate keys, and execute the jobs on
+    // each board in parallel
+    Seq<uint64_t>* boardJobs = new Seq<uint64_t> [numBoards];
+    for (uint32_t d = 0; d < numDevices; d++) {
+      ProgRouterPlan* plan = &plans[devPlan[d]];
+      for (uint32_t p = 0; p < numPins; p++) {
+        int32_t last = senderJob[d*numPins + p];
+        for (int32_t j = firstJob[d*numPins + p]; j <= last; j++) {
+          ProgRouterJob* job = &plan->jobs.elems[j];
+          uint32_t b = job->boardY * numBoardsX + job->boardX;
+          boardJobs[b].append(((uint64_t) devPlan[d] << 32) | j);
+        }
+      }
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for (uint32_t b = 0; b < numBoards; b++)
+      for (int i = 0; i < boardJobs[b].numElems; i++) {
+        uint64_t ref = boardJobs[b].elems[i];
+        progRouterTables->runJob(&plans[ref >> 32], (uint32_t) ref);
+      }
+    #pragma omp parallel for schedule(dynamic)
+    for (uint32_t b = 0; b < numBoards; b++)
+      for (int i = 0; i < boardJobs[b].numElems; i++) {
+        uint64_t ref = boardJobs[b].elems[i];
+        progRouterTables->patchJob(&plans[ref >> 32], (uint32_t) ref);
+      }
+    delete [] boardJobs;
+
+    // Fill in the routing keys used by senders
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (uint32_t d = 0; d < numDevices; d++) {
+      for (uint32_t p = 0; p < numPins; p++) {
+        uint32_t owner = keyOwner[d*numPins + p];
+        ProgRouterPlan* plan = &plans[devPlan[owner / numPins]];
+        int32_t j = senderJob[owner];
+        Seq<POutEdge>* edges = outTable[d][p];
+        edges->elems[edges->numElems-2].threadMaskLow =
+          j < 0 ? 0 : plan->jobs.elems[j].key;
+      }
+    }
+    delete [] plans;
+    delete [] devPlan;
+    delete [] firstJob;
+    delete [] senderJob;
+    delete [] keyOwner;
+  }
+
+  // Sets of boards are held in 64-bit masks, and the links of a
+  // multicast tree in arrays of 64 elements, so the mesh must have at
+  // most 64 boards
+  static_assert((1 << (TinselMeshXBits + TinselMeshYBits)) <= 64,
+    "PGraph: board mesh too large for 64-bit board sets");
+
+  // Determine the boards, other than the sender's, reached by the given
+  // pin of the given device (bit y*numBoardsX + x is set for board (x, y))
+  // (Only valid after mapper is called)
+  uint64_t destBoards(PDeviceId d, PinId p) {
+    uint32_t src = getThreadId(toDeviceAddr[d]) >>
+                     TinselLogThreadsPerMailbox;
+    PDeviceId* out = graph.outgoing(d);
+    PinId* pins = graph.pins(d);
+    uint64_t boards = 0;
+    for (uint32_t i = 0; i < graph.fanOut(d); i++) {
+      if (pins[i] != p) continue;
+      uint32_t mbox = getThreadId(toDeviceAddr[out[i]]) >>
+                        TinselLogThreadsPerMailbox;
+      boards |= 1ull << (destY(mbox)*numBoardsX + destX(mbox));
+    }
+    return boards & ~(1ull << (destY(src)*numBoardsX + destX(src)));
+  }
+
+  // Choose the multicast tree used by each (device, pin) pair: the tree
+  // crossing the fewest inter-board links if steinerRouting is set (see
+  // ProgRouterMesh::minLinkBranching()), or the XY tree otherwise, then
+  // rebalance the trees if linkBalancing is set
+  // (Only valid after mapper is called)
+  void chooseRoutes() {
+    const uint32_t numPins = POLITE_NUM_PINS;
+    uint64_t* boards = new uint64_t [numDevices*numPins];
+    if (routeYX != NULL) free(routeYX);
+    routeYX = (uint64_t*) calloc(numDevices*numPins, sizeof(uint64_t));
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (uint32_t d = 0; d < numDevices; d++) {
+      uint32_t src = getThreadId(toDeviceAddr[d]) >>
+                       TinselLogThreadsPerMailbox;
+      for (uint32_t p = 0; p < numPins; p++) {
+        uint32_t dp = d*numPins + p;
+        boards[dp] = destBoards(d, p);
+        if (steinerRouting && boards[dp] != 0)
+          routeYX[dp] = progRouterTables->minLinkBranching(
+                          destX(src), destY(src), boards[dp]);
+      }
+    }
+    if (linkBalancing) balanceLinkLoads(boards);
+    delete [] boards;
+  }
+
+  // Reroute (device, pin) pairs so as to reduce the load on the busiest
+  // inter-board links, assuming that each device sends once on each pin
+  // per round (or as often as given by setMessageRates()).  Each pair
+  // may use the tree given by chooseRoutes(), the XY tree, or the YX
+  // tree.  Routes start out as given by chooseRoutes(), and each pair
+  // with destinations to the east, off the sender's row, is then
+  // rerouted in turn along whichever tree has the least loaded busiest
+  // link, until no more routes change.  The boards reached by each pair
+  // are given.
+  void balanceLinkLoads(uint64_t* boards) {
+    const uint32_t numPins = POLITE_NUM_PINS;
+    const uint32_t numBoards = numBoardsX * numBoardsY;
+    const uint32_t maxPasses = 8;
+    // Trees that each pair may use, and the one in use
+    uint64_t* chosen = (uint64_t*)
+      malloc(numDevices*numPins * sizeof(uint64_t));
+    memcpy(chosen, routeYX, numDevices*numPins * sizeof(uint64_t));
+    uint8_t* current = (uint8_t*) calloc(numDevices*numPins, sizeof(uint8_t));
+    uint64_t* loads = (uint64_t*) calloc(numBoards * 4, sizeof(uint64_t));
+    // Links of each tree (a tree never revisits a board)
+    uint32_t links[3][64];
+    for (uint32_t pass = 0; pass <= maxPasses; pass++) {
+      uint64_t changed = 0;
+      for (uint32_t d = 0; d < numDevices; d++) {
+        uint64_t weight = messageRates ? messageRates->elems[d] : 1;
+        uint32_t src = getThreadId(toDeviceAddr[d]) >>
+                         TinselLogThreadsPerMailbox;
+        uint32_t srcX = destX(src), srcY = destY(src);
+        // Boards in the east, off the sender's row
+        uint64_t east = 0;
+        for (uint32_t y = 0; y < numBoardsY; y++)
+          if (y != srcY)
+            for (uint32_t x = srcX+1; x < numBoardsX; x++)
+              east |= 1ull << (y*numBoardsX + x);
+        for (uint32_t p = 0; p < numPins; p++) {
+          uint32_t dp = d*numPins + p;
+          if (weight == 0 || boards[dp] == 0) continue;
+          // First pass adds the initial routes; later passes reroute
+          if (pass > 0 && (boards[dp] & east) == 0) continue;
+          uint64_t trees[3] = { chosen[dp], 0, ~0ull };
+          uint32_t n[3];
+          for (uint32_t t = 0; t < 3; t++)
+            n[t] = progRouterTables->routeLinks(srcX, srcY,
+                     boards[dp], trees[t], links[t]);
+          uint32_t cur = current[dp];
+          if (pass > 0) {
+            for (uint32_t i = 0; i < n[cur]; i++)
+              loads[links[cur][i]] -= weight;
+            // Compare busiest links, then total load, of each tree
+            uint64_t busiest[3] = { 0, 0, 0 }, sum[3] = { 0, 0, 0 };
+            uint32_t best = 0;
+            for (uint32_t t = 0; t < 3; t++) {
+              for (uint32_t i = 0; i < n[t]; i++) {
+                uint64_t load = loads[links[t][i]] + weight;
+                if (load > busiest[t]) busiest[t] = load;
+                sum[t] += load;
+              }
+              if (busiest[t] < busiest[best] ||
+                   (busiest[t] == busiest[best] && sum[t] < sum[best]))
+                best = t;
+            }
+            if (best != cur) {
+              current[dp] = best;
+              routeYX[dp] = trees[best];
+              cur = best;
+              changed++;
+            }
+          }
+          for (uint32_t i = 0; i < n[cur]; i++)
+            loads[links[cur][i]] += weight;
+        }
+      }
+      if (pass > 0 && changed == 0) break;
+    }
+    free(loads);
+    free(current);
+    free(chosen);
+  }
+
+  // Compute routing tables
+  // (Only valid after mapper is called)
+  void computeRoutingTables() {
+    const uint32_t numMailboxes = TinselMaxThreads >>
+                                    TinselLogThreadsPerMailbox;
+    // Allocate per-board programmable routing tables
+    progRouterTables = new ProgRouterMesh(numBoardsX, numBoardsY);
+    if (routeYX != NULL) { free(routeYX); routeYX = NULL; }
+    if ((linkBalancing || steinerRouting) && numBoardsX * numBoardsY > 1)
+      chooseRoutes();
+    sharedInKeys =
+      new std::unordered_multimap<uint64_t, uint32_t> [numMailboxes];
+    numSharedInKeys = numSharedRouterKeys = 0;
+    if (parallelRouting)
+      computeRoutingTablesParallel();
+    else
+      computeRoutingTablesSerial();
+    delete [] sharedInKeys;
+    sharedInKeys = NULL;
+  }
+
+  // Estimate the number of messages crossing each inter-board link per
+  // round, assuming that each device sends once on each pin per round
+  // (or as often as given by setMessageRates()), and print a summary,
+  // including a histogram of the load on links within the mesh, and the
+  // total that XY routing would give, if other routes are used
+  // (Only valid after mapper is called)
+  void reportLinkLoads() {
+    const uint32_t numBoards = numBoardsX * numBoardsY;
+    const char* dirNames[] = { "north", "south", "east", "west" };
+    const uint32_t numBuckets = 10;
+    uint64_t* loads = (uint64_t*) calloc(numBoards * 4, sizeof(uint64_t));
+    // Total link crossings, with the chosen multicast trees, with XY
+    // multicast trees, and with unicasts
+    uint64_t total = 0, totalXY = 0, unicast = 0;
+    #pragma omp parallel
+    {
+      uint64_t* myLoads =
+        (uint64_t*) calloc(numBoards * 4, sizeof(uint64_t));
+      uint32_t links[64];
+      #pragma omp for schedule(dynamic, 256) \
+        reduction(+:total, totalXY, unicast)
+      for (uint32_t d = 0; d < numDevices; d++) {
+        uint64_t weight = messageRates ? messageRates->elems[d] : 1;
+        uint32_t src = getThreadId(toDeviceAddr[d]) >>
+                         TinselLogThreadsPerMailbox;
+        uint32_t srcX = destX(src), srcY = destY(src);
+        for (uint32_t p = 0; p < POLITE_NUM_PINS; p++) {
+          uint64_t boards = destBoards(d, p);
+          if (boards == 0) continue;
+          for (uint32_t b = 0; b < numBoards; b++) {
+            if (!(boards & (1ull << b))) continue;
+            uint32_t x = b % numBoardsX, y = b / numBoardsX;
+            unicast += weight * ((x > srcX ? x - srcX : srcX - x) +
+                                   (y > srcY ? y - srcY : srcY - y));
+          }
+          uint64_t yx = routeYX != NULL ? routeYX[d*POLITE_NUM_PINS + p] : 0;
+          if (yx != 0)
+            totalXY += weight * progRouterTables->routeLinks(srcX, srcY,
+                                  boards, 0, links);
+          uint32_t n = progRouterTables->routeLinks(srcX, srcY,
+                         boards, yx, links);
+          for (uint32_t i = 0; i < n; i++) myLoads[links[i]] += weight;
+          total += weight * n;
+          if (yx == 0) totalXY += weight * n;
+        }
+      }
+      #pragma omp critical
+      for (uint32_t i = 0; i < numBoards * 4; i++) loads[i] += myLoads[i];
+      free(myLoads);
+    }
+    uint32_t busiest = 0;
+    for (uint32_t i = 0; i < numBoards * 4; i++)
+      if (loads[i] > loads[busiest]) busiest = i;
+    if (routeYX != NULL)
+      printf("  Inter-board link crossings per round: %lu "
+             "(%lu with XY routing, %lu if unicast)\n",
+        total, totalXY, unicast);
+    else
+      printf("  Inter-board link crossings per round: %lu (%lu if unicast)\n",
+        total, unicast);
+    if (total > 0) {
+      printf("  Busiest inter-board link: %lu crossings, board (%u, %u) %s\n",
+        loads[busiest], (busiest/4) % numBoardsX, (busiest/4) / numBoardsX,
+        dirNames[busiest%4]);
+      // Histogram of links within the mesh, by load
+      uint64_t width = (loads[busiest] + numBuckets) / numBuckets;
+      uint32_t count[numBuckets];
+      for (uint32_t i = 0; i < numBuckets; i++) count[i] = 0;
+      for (uint32_t i = 0; i < numBoards * 4; i++) {
+        uint32_t x = (i/4) % numBoardsX, y = (i/4) / numBoardsX;
+        uint32_t dir = i%4;
+        if ((dir == 0 && y+1 == numBoardsY) || (dir == 1 && y == 0) ||
+            (dir == 2 && x+1 == numBoardsX) || (dir == 3 && x == 0))
+          continue;
+        count[loads[i] / width]++;
+      }
+      printf("  Inter-board links by crossings per round:\n");
+      for (uint32_t i = 0; i < numBuckets; i++)
+        if (i*width <= loads[busiest])
+          printf("    %lu-%lu: %u\n", i*width, (i+1)*width - 1, count[i]);
+    }
+    free(loads);
+  }
+
+  // Hash an edge label, as stored in the input tables
+  uint32_t hashInEdgeLabel(E* label) {
+    if (std::is_same<E, None>::value) return 0;
+    PInEdge<E> in;
+    memset(&in, 0, sizeof(in));
+    in.edge = *label;
+    return (uint32_t) hashWords(0, (uint8_t*) &in.edge, sizeof(E));
+  }
+
+  // Check the routing tables using a functional model of the
+  // programmable routers (see ProgRouterMesh::simulate()).  The messages
+  // sent by each device on each pin must reach exactly the devices
+  // connected to that pin, with the right edge labels, along the
+  // inter-board links assumed by reportLinkLoads().  Exits on failure.
+  // (Only valid after mapper is called)
+  void verifyRoutingTables() {
+    const uint32_t numPins = POLITE_NUM_PINS;
+    // Local keys must not overwrite the message payload
+    const uint32_t payloadOffset = offsetof(PMessage<M>, payload);
+    uint64_t numMessages = 0, numDeliveries = 0, numHops = 0;
+    uint32_t maxHops = 0;
+    // First problem found, if any
+    const char* problem = NULL;
+    uint32_t problemAt = ~0u;
+    #pragma omp parallel
+    {
+      Seq<ProgRouterDelivery> dels;
+      Seq<uint32_t> links;
+      Seq<uint64_t> expected, actual;
+      uint32_t estimate[64];
+      #pragma omp for schedule(dynamic, 256) \
+        reduction(+:numMessages, numDeliveries, numHops) reduction(max:maxHops)
+      for (uint32_t d = 0; d < numDevices; d++) {
+        uint32_t src = getThreadId(toDeviceAddr[d]) >>
+                         TinselLogThreadsPerMailbox;
+        uint32_t srcX = destX(src), srcY = destY(src);
+        PDeviceId* out = graph.outgoing(d);
+        PinId* pins = graph.pins(d);
+        for (uint32_t p = 0; p < numPins; p++) {
+          const char* err = NULL;
+          // Destinations, according to the edge list
+          expected.clear();
+          for (uint32_t i = 0; i < graph.fanOut(d); i++) {
+            if (pins[i] != (PinId) p) continue;
+            uint32_t label = std::is_same<E, None>::value ? 0 :
+              hashInEdgeLabel(&edgeLabels[graph.outOffsets[d] + i]);
+            expected.append(((uint64_t) out[i] << 32) | label);
+          }
+          if (expected.numElems > 0) numMessages++;
+          // Deliveries, according to the output tables and ProgRouters
+          dels.clear();
+          links.clear();
+          uint32_t hops = 0;
+          POutEdge* edge = outTable[d][p]->elems;
+          for (; err == NULL && edge->key != InvalidKey; edge++) {
+            if (edge->mbox == tinselUseRoutingKey()) {
+              err = progRouterTables->simulate(srcX, srcY,
+                      edge->threadMaskLow, &dels, &links, &hops);
+            }
+            else {
+              ProgRouterDelivery del;
+              del.mbox = edge->mbox;
+              del.threadMaskLow = edge->threadMaskLow;
+              del.threadMaskHigh = edge->threadMaskHigh;
+              del.key = edge->key;
+              del.keyBytes = sizeof(uint16_t);
+              dels.append(del);
+            }
+          }
+          numHops += links.numElems;
+          if (hops > maxHops) maxHops = hops;
+          // Destinations, according to the input tables
+          actual.clear();
+          for (int i = 0; err == NULL && i < dels.numElems; i++) {
+            ProgRouterDelivery* del = &dels.elems[i];
+            if (del->keyBytes > payloadOffset)
+              err = "local key overwrites message payload";
+            for (uint32_t j = 0; err == NULL && j < 64; j++) {
+              uint32_t mask = j < 32 ? del->threadMaskLow :
+                                del->threadMaskHigh;
+              if (!(mask & (1u << (j & 31)))) continue;
+              numDeliveries++;
+              uint32_t t = (del->mbox << TinselLogThreadsPerMailbox) | j;
+              uint32_t key = del->key & 0xffff;
+              if (t >= TinselMaxThreads || inTableHeaders[t] == NULL ||
+                    key >= (uint32_t) inTableHeaders[t]->numElems) {
+                err = "message reaches thread with no entry for its key";
+                break;
+              }
+              PInHeader<E>* header = &inTableHeaders[t]->elems[key];
+              uint32_t n = header->numReceivers;
+              uint32_t numHeaderEdges = n < POLITE_EDGES_PER_HEADER ?
+                n : POLITE_EDGES_PER_HEADER;
+              if (header->restIndex + n - numHeaderEdges >
+                    (uint32_t) inTableRest[t]->numElems) {
+                err = "input table entry overflows table";
+                break;
+              }
+              for (uint32_t r = 0; r < n; r++) {
+                PInEdge<E>* in = r < numHeaderEdges ? &header->edges[r] :
+                  &inTableRest[t]->elems[header->restIndex + r -
+                                           numHeaderEdges];
+                if (in->devId >= numDevicesOnThread[t]) {
+                  err = "input table refers to non-existent device";
+                  break;
+                }
+                uint32_t label = std::is_same<E, None>::value ? 0 :
+                  hashInEdgeLabel(&in->edge);
+                actual.append(((uint64_t) fromDeviceAddr[t][in->devId]
+                                 << 32) | label);
+              }
+            }
+          }
+          if (err == NULL) {
+            std::sort(expected.elems, expected.elems + expected.numElems);
+            std::sort(actual.elems, actual.elems + actual.numElems);
+            if (actual.numElems != expected.numElems ||
+                  memcmp(actual.elems, expected.elems,
+                    actual.numElems * sizeof(uint64_t)) != 0)
+              err = "messages do not reach exactly the connected devices";
+          }
+          // Inter-board links, according to routeLinks()
+          if (err == NULL) {
+            uint64_t yx = routeYX != NULL ? routeYX[d*numPins + p] : 0;
+            uint32_t n = progRouterTables->routeLinks(srcX, srcY,
+                           destBoards(d, p), yx, estimate);
+            std::sort(estimate, estimate + n);
+            std::sort(links.elems, links.elems + links.numElems);
+            if ((uint32_t) links.numElems != n || memcmp(links.elems, estimate,
+                  n * sizeof(uint32_t)) != 0)
+              err = "messages do not follow the expected multicast tree";
+          }
+          if (err != NULL) {
+            #pragma omp critical
+            if (d*numPins + p < problemAt) {
+              problem = err;
+              problemAt = d*numPins + p;
+            }
+          }
+        }
+      }
+    }
+    if (problem != NULL) {
+      printf("Routing tables invalid for device %u, pin %u: %s\n",
+        problemAt / numPins, problemAt % numPins, problem);
+      exit(EXIT_FAILURE);
+    }
+    if (chatty > 0) {
+      printf("POLite routing tables verified:\n");
+      printf("  Messages: %lu (%lu deliveries)\n",
+        numMessages, numDeliveries);
+      printf("  Inter-board hops: %lu (longest route %u)\n",
+        numHops, maxHops);
+    }
   }
 
   // Release all structures
   void releaseAll() {
     if (devices != NULL) {
       free(devices);
+      free(dirtyDevices);
+      dirtyDevices = NULL;
       free(toDeviceAddr);
       free(numDevicesOnThread);
       for (uint32_t t = 0; t < TinselMaxThreads; t++)
         if (fromDeviceAddr[t] != NULL) free(fromDeviceAddr[t]);
       free(fromDeviceAddr);
-      for (uint32_t t = 0; t < TinselMaxThreads; t++)
-        if (vertexMem[t] != NULL) free(vertexMem[t]);
+      if (partitionArena != NULL) free(partitionArena);
+      partitionArena = NULL;
       free(vertexMem);
       free(vertexMemSize);
       free(vertexMemBase);
-      for (uint32_t t = 0; t < TinselMaxThreads; t++)
-        if (threadMem[t] != NULL) free(threadMem[t]);
       free(threadMem);
       free(threadMemSize);
       free(threadMemBase);
-      for (uint32_t t = 0; t < TinselMaxThreads; t++)
-        if (inEdgeHeaderMem[t] != NULL) free(inEdgeHeaderMem[t]);
       free(inEdgeHeaderMem);
       free(inEdgeHeaderMemSize);
       free(inEdgeHeaderMemBase);
-      for (uint32_t t = 0; t < TinselMaxThreads; t++)
-        if (inEdgeRestMem[t] != NULL) free(inEdgeRestMem[t]);
       free(inEdgeRestMem);
       free(inEdgeRestMemSize);
       free(inEdgeRestMemBase);
-      for (uint32_t t = 0; t < TinselMaxThreads; t++)
-        if (outEdgeMem[t] != NULL) free(outEdgeMem[t]);
       free(outEdgeMem);
       free(outEdgeMemSize);
       free(outEdgeMemBase);
@@ -769,41 +2305,321 @@ template <typename DeviceType,
       free(outTable);
       outTable = NULL;
     }
-    if (progRouterTables != NULL) delete progRouterTables;
+    if (progRouterTables != NULL) {
+      delete progRouterTables;
+      progRouterTables = NULL;
+    }
+    if (routeYX != NULL) {
+      free(routeYX);
+      routeYX = NULL;
+    }
   }
 
-  // Implement mapping to tinsel threads
-  void map() {
-    // Let's measure some times
-    struct timeval placementStart, placementFinish;
-    struct timeval routingStart, routingFinish;
-    struct timeval initStart, initFinish;
+  // Determine key identifying the result of the mapper for the
+  // current graph, board dimensions, and mapper settings
+  // (Only valid once the graph is frozen)
+  uint64_t mappingKey() {
+    uint32_t params[] = {
+      PMapCacheVersion, TinselMaxThreads, TinselLogThreadsPerMailbox,
+      TinselMailboxMeshXLen, TinselMailboxMeshYLen,
+      TinselLogBytesPerSRAMPartition, TinselLogBytesPerDRAMPartition,
+      TinselPOLiteProgRouterBase, POLITE_NUM_PINS, POLITE_EDGES_PER_HEADER,
+      (uint32_t) sizeof(PState<S>), (uint32_t) sizeof(E),
+      (uint32_t) sizeof(PMessage<M>),
+      (uint32_t) sizeof(PThread<DeviceType, S, E, M>),
+      numBoardsX, numBoardsY, numDevices,
+      firstMirror, numMirrors, mirrorMaxFanIn,
+      mapVerticesToDRAM, mapInEdgeHeadersToDRAM,
+      mapInEdgeRestToDRAM, mapOutEdgesToDRAM, mapRegionsAutomatically,
+      placerEffort, flatPlacement, localityOrder, linkBalancing,
+      steinerRouting
+    };
+    uint64_t h = hashBytes(0, params, sizeof(params));
+    for (uint32_t i = 0; i < sizeof(PMapperEnvVars)/sizeof(char*); i++) {
+      const char* str = getenv(PMapperEnvVars[i]);
+      if (str == NULL) str = "";
+      h = hashBytes(h, str, strlen(str) + 1);
+    }
+    uint64_t numEdges = graph.numEdges;
+    h = hashBytes(h, &numEdges, sizeof(uint64_t));
+    h = hashBytes(h, graph.outOffsets, (numDevices+1) * sizeof(uint64_t));
+    h = hashBytes(h, graph.outNeighbours, numEdges * sizeof(NodeId));
+    h = hashBytes(h, graph.outPins, numEdges * sizeof(PinId));
+    if (! std::is_same<E, None>::value)
+      h = hashBytes(h, edgeLabels, numEdges * sizeof(E));
+    Seq<uint32_t>* weights[] = { deviceWeights, messageRates };
+    for (uint32_t i = 0; i < 2; i++) {
+      uint32_t present = weights[i] != NULL;
+      h = hashBytes(h, &present, sizeof(uint32_t));
+      if (present)
+        h = hashBytes(h, perDevice(weights[i]), numDevices * sizeof(uint32_t));
+    }
+    return h;
+  }
 
-    // Release all mapping and heap structures
-    releaseAll();
+  // Determine name of mapping cache file for given key
+  void mapCacheFile(char* name, uint32_t len, uint64_t key) {
+    snprintf(name, len, "%s/polite-%016lx.map",
+      mapCacheDir, (unsigned long) key);
+  }
 
-    // Reallocate mapping structures
-    allocateMapping();
+  // Save result of the mapper to the mapping cache
+  // (The file is written under a temporary name and then renamed,
+  // so that concurrent runs never see a partially-written file)
+  void saveMapping(uint64_t key) {
+    char name[4096], tmpName[4096 + 32];
+    mapCacheFile(name, sizeof(name), key);
+    snprintf(tmpName, sizeof(tmpName), "%s.%d.tmp", name, (int) getpid());
+    FILE* fp = fopen(tmpName, "wb");
+    if (fp == NULL) {
+      printf("Warning: can't write mapping cache file %s\n", tmpName);
+      return;
+    }
+    bool ok = true;
+    // Header
+    uint32_t header[] = { PMapCacheMagic, PMapCacheVersion,
+                          numDevices, numBoardsX, numBoardsY };
+    ok = ok && fwrite(header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(&key, sizeof(uint64_t), 1, fp) == 1;
+    // Mapping between device ids and device addresses
+    ok = ok && fwrite(numDevicesOnThread, sizeof(uint32_t),
+                 TinselMaxThreads, fp) == TinselMaxThreads;
+    for (uint32_t t = 0; ok && t < TinselMaxThreads; t++) {
+      uint32_t n = numDevicesOnThread[t];
+      ok = fwrite(fromDeviceAddr[t], sizeof(PDeviceId), n, fp) == n;
+    }
+    ok = ok && fwrite(toDeviceAddr, sizeof(PDeviceAddr),
+                 numDevices, fp) == numDevices;
+    // Partitions
+    uint8_t** mem[] = { vertexMem, threadMem,
+      inEdgeHeaderMem, inEdgeRestMem, outEdgeMem };
+    uint32_t* size[] = { vertexMemSize, threadMemSize,
+      inEdgeHeaderMemSize, inEdgeRestMemSize, outEdgeMemSize };
+    uint32_t* base[] = { vertexMemBase, threadMemBase,
+      inEdgeHeaderMemBase, inEdgeRestMemBase, outEdgeMemBase };
+    for (uint32_t r = 0; ok && r < 5; r++) {
+      ok = fwrite(size[r], sizeof(uint32_t),
+             TinselMaxThreads, fp) == TinselMaxThreads;
+      ok = ok && fwrite(base[r], sizeof(uint32_t),
+                   TinselMaxThreads, fp) == TinselMaxThreads;
+    }
+    for (uint32_t r = 0; ok && r < 5; r++)
+      for (uint32_t t = 0; ok && t < TinselMaxThreads; t++)
+        ok = fwrite(mem[r][t], 1, size[r][t], fp) == size[r][t];
+    // Programmable routing tables
+    ok = ok && progRouterTables->save(fp);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmpName, name) != 0) {
+      printf("Warning: failed to write mapping cache file %s\n", name);
+      remove(tmpName);
+    }
+  }
 
-    // Start placement timer
-    gettimeofday(&placementStart, NULL);
+  // Load result of the mapper from the mapping cache, if possible
+  // (Mapping structures must already be allocated)
+  // Returns false if there is no usable cache file
+  bool loadMapping(uint64_t key) {
+    char name[4096];
+    mapCacheFile(name, sizeof(name), key);
+    FILE* fp = fopen(name, "rb");
+    if (fp == NULL) return false;
+    // Check header
+    uint32_t header[5];
+    uint64_t fileKey;
+    bool ok = fread(header, sizeof(header), 1, fp) == 1 &&
+              fread(&fileKey, sizeof(uint64_t), 1, fp) == 1;
+    if (!ok || header[0] != PMapCacheMagic ||
+          header[1] != PMapCacheVersion || header[2] != numDevices ||
+            header[3] != numBoardsX || header[4] != numBoardsY ||
+              fileKey != key) {
+      fclose(fp);
+      return false;
+    }
+    allocatePartitionArrays();
+    progRouterTables = new ProgRouterMesh(numBoardsX, numBoardsY);
+    // Mapping between device ids and device addresses
+    ok = fread(numDevicesOnThread, sizeof(uint32_t),
+           TinselMaxThreads, fp) == TinselMaxThreads;
+    for (uint32_t t = 0; ok && t < TinselMaxThreads; t++) {
+      uint32_t n = numDevicesOnThread[t];
+      ok = n <= numDevices;
+      if (ok && n > 0) {
+        fromDeviceAddr[t] = (PDeviceId*) malloc(sizeof(PDeviceId) * n);
+        ok = fread(fromDeviceAddr[t], sizeof(PDeviceId), n, fp) == n;
+      }
+    }
+    ok = ok && fread(toDeviceAddr, sizeof(PDeviceAddr),
+                 numDevices, fp) == numDevices;
+    // Check that device ids are in range and that the two maps are
+    // mutual inverses, since ids are used as array indices
+    uint64_t total = 0;
+    for (uint32_t t = 0; ok && t < TinselMaxThreads; t++) {
+      uint32_t n = numDevicesOnThread[t];
+      ok = n < maxLocalDeviceId();
+      for (uint32_t d = 0; ok && d < n; d++) {
+        PDeviceId id = fromDeviceAddr[t][d];
+        ok = id < numDevices && toDeviceAddr[id] == makeDeviceAddr(t, d);
+      }
+      total += n;
+    }
+    ok = ok && total == numDevices;
+    // Partitions
+    uint8_t** mem[] = { vertexMem, threadMem,
+      inEdgeHeaderMem, inEdgeRestMem, outEdgeMem };
+    uint32_t* size[] = { vertexMemSize, threadMemSize,
+      inEdgeHeaderMemSize, inEdgeRestMemSize, outEdgeMemSize };
+    uint32_t* base[] = { vertexMemBase, threadMemBase,
+      inEdgeHeaderMemBase, inEdgeRestMemBase, outEdgeMemBase };
+    for (uint32_t r = 0; ok && r < 5; r++) {
+      ok = fread(size[r], sizeof(uint32_t),
+             TinselMaxThreads, fp) == TinselMaxThreads;
+      ok = ok && fread(base[r], sizeof(uint32_t),
+                  TinselMaxThreads, fp) == TinselMaxThreads;
+      for (uint32_t t = 0; ok && t < TinselMaxThreads; t++)
+        ok = size[r][t] <= (1 << TinselLogBytesPerDRAMPartition);
+    }
+    for (uint32_t t = 0; ok && t < TinselMaxThreads; t++)
+      ok = numDevicesOnThread[t] * sizeof(PState<S>) <= vertexMemSize[t];
+    if (ok) allocatePartitionArena();
+    for (uint32_t r = 0; ok && r < 5; r++)
+      for (uint32_t t = 0; ok && t < TinselMaxThreads; t++)
+        ok = fread(mem[r][t], 1, size[r][t], fp) == size[r][t];
+    // Programmable routing tables
+    ok = ok && progRouterTables->load(fp);
+    fclose(fp);
+    if (!ok) {
+      printf("Warning: ignoring corrupt mapping cache file %s\n", name);
+      releaseAll();
+      allocateMapping();
+      return false;
+    }
+    // Pointers to device states
+    for (uint32_t t = 0; t < TinselMaxThreads; t++)
+      for (uint32_t d = 0; d < numDevicesOnThread[t]; d++)
+        devices[fromDeviceAddr[t][d]] =
+          (PState<S>*) &vertexMem[t][d * sizeof(PState<S>)];
+    return true;
+  }
+
+  // Determine tinsel thread id from board, mailbox, and thread coords
+  uint32_t toThreadId(uint32_t boardX, uint32_t boardY,
+                      uint32_t boxX, uint32_t boxY, uint32_t threadNum) {
+    uint32_t threadId = boardY;
+    threadId = (threadId << TinselMeshXBits) | boardX;
+    threadId = (threadId << TinselMailboxMeshYBits) | boxY;
+    threadId = (threadId << TinselMailboxMeshXBits) | boxX;
+    threadId = (threadId << (TinselLogCoresPerMailbox +
+                  TinselLogThreadsPerCore)) | threadNum;
+    return threadId;
+  }
+
+  // Map given devices to given thread
+  void setThreadDevices(uint32_t threadId, uint32_t numDevs,
+                          const PDeviceId* ids) {
+    // Populate fromDeviceAddr mapping
+    numDevicesOnThread[threadId] = numDevs;
+    fromDeviceAddr[threadId] = (PDeviceId*)
+      malloc(sizeof(PDeviceId) * numDevs);
+    for (uint32_t devNum = 0; devNum < numDevs; devNum++)
+      fromDeviceAddr[threadId][devNum] = ids[devNum];
+
+    // Populate toDeviceAddr mapping
+    assert(numDevs < maxLocalDeviceId());
+    for (uint32_t devNum = 0; devNum < numDevs; devNum++) {
+      PDeviceAddr devAddr = makeDeviceAddr(threadId, devNum);
+      toDeviceAddr[ids[devNum]] = devAddr;
+    }
+  }
+
+  // Reorder the devices on each thread to improve cache locality.  Each
+  // thread's share of the data cache is small, and the cache is
+  // partitioned by thread, so what matters is the locality of each
+  // thread's own accesses: the receivers of a message are handled one
+  // after the other, so the receivers of each sender are made
+  // contiguous, starting with the senders having the most receivers
+  void orderDevicesForLocality() {
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (uint32_t t = 0; t < TinselMaxThreads; t++) {
+      uint32_t numDevs = numDevicesOnThread[t];
+      if (numDevs < 2) continue;
+      PDeviceId* ids = fromDeviceAddr[t];
+      // (sender, local receiver) pairs, sorted by sender
+      std::vector<std::pair<PDeviceId, uint32_t>> pairs;
+      for (uint32_t d = 0; d < numDevs; d++) {
+        NodeId* in = graph.incoming(ids[d]);
+        for (uint32_t j = 0; j < graph.fanIn(ids[d]); j++)
+          pairs.push_back(std::make_pair(in[j], d));
+      }
+      std::sort(pairs.begin(), pairs.end());
+      // Groups of pairs with the same sender (start and end index),
+      // largest first
+      std::vector<std::pair<uint64_t, uint64_t>> groups;
+      for (uint64_t i = 0; i < pairs.size(); ) {
+        uint64_t j = i;
+        while (j < pairs.size() && pairs[j].first == pairs[i].first) j++;
+        groups.push_back(std::make_pair(i, j));
+        i = j;
+      }
+      std::stable_sort(groups.begin(), groups.end(),
+        [](const std::pair<uint64_t, uint64_t>& a,
+           const std::pair<uint64_t, uint64_t>& b) {
+          return a.second - a.first > b.second - b.first; });
+      // Emit each device the first time it's seen
+      std::vector<bool> done(numDevs, false);
+      std::vector<PDeviceId> order;
+      for (auto& g : groups) {
+        for (uint64_t i = g.first; i < g.second; i++) {
+          uint32_t d = pairs[i].second;
+          if (!done[d]) { done[d] = true; order.push_back(ids[d]); }
+        }
+      }
+      for (uint32_t d = 0; d < numDevs; d++)
+        if (!done[d]) order.push_back(ids[d]);
+      // Update mappings
+      for (uint32_t d = 0; d < numDevs; d++) {
+        ids[d] = order[d];
+        toDeviceAddr[order[d]] = makeDeviceAddr(t, d);
+      }
+    }
+  }
+
+  // Partition and place hierarchically: partition the graph between
+  // boards, then each board's subgraph between mailboxes, then each
+  // mailbox's subgraph between threads, placing at each level
+  void placeHierarchical(uint64_t* boardsCost, uint64_t* totalBoxesCost) {
+    // Partitions may hold no more devices than fit on their threads
+    uint64_t threadCap = maxDevicesPerThread();
+    uint64_t boxCap = threadCap << TinselLogThreadsPerMailbox;
+    uint64_t boardCap = boxCap * TinselMailboxMeshXLen * TinselMailboxMeshYLen;
+
+    // Device weights, if any
+    const uint32_t* weights = perDevice(deviceWeights);
+    const uint32_t* rates = perDevice(messageRates);
 
     // Partition into subgraphs, one per board
-    Placer boards(&graph, numBoardsX, numBoardsY);
+    Placer boards(&graph, numBoardsX, numBoardsY, boardCap, weights, rates);
 
     // Place subgraphs onto 2D mesh
-    const uint32_t placerEffort = 8;
     boards.place(placerEffort);
+    *boardsCost = boards.currentCost;
+
+    // Total cost of mailbox placements
+    uint64_t boxesCost = 0;
 
     // For each board
-    #pragma omp parallel for collapse(2)
+    #pragma omp parallel for collapse(2) reduction(+:boxesCost)
     for (uint32_t boardY = 0; boardY < numBoardsY; boardY++) {
       for (uint32_t boardX = 0; boardX < numBoardsX; boardX++) {
         // Partition into subgraphs, one per mailbox
         PartitionId b = boards.mapping[boardY][boardX];
         Placer boxes(&boards.subgraphs[b], 
-                 TinselMailboxMeshXLen, TinselMailboxMeshYLen);
+                 TinselMailboxMeshXLen, TinselMailboxMeshYLen, boxCap,
+                 weights, rates);
+        // Share the annealer's time budget between the boards
+        boxes.annealTime = boards.annealTime * omp_get_num_threads() /
+                             (numBoardsX * numBoardsY);
         boxes.place(placerEffort);
+        boxesCost += boxes.currentCost;
 
         // For each mailbox
         for (uint32_t boxX = 0; boxX < TinselMailboxMeshXLen; boxX++) {
@@ -811,41 +2627,135 @@ template <typename DeviceType,
             // Partition into subgraphs, one per thread
             uint32_t numThreads = 1<<TinselLogThreadsPerMailbox;
             PartitionId t = boxes.mapping[boxY][boxX];
-            Placer threads(&boxes.subgraphs[t], numThreads, 1);
+            Placer threads(&boxes.subgraphs[t], numThreads, 1, threadCap,
+                           weights, rates);
 
             // For each thread
             for (uint32_t threadNum = 0; threadNum < numThreads; threadNum++) {
-              // Determine tinsel thread id
-              uint32_t threadId = boardY;
-              threadId = (threadId << TinselMeshXBits) | boardX;
-              threadId = (threadId << TinselMailboxMeshYBits) | boxY;
-              threadId = (threadId << TinselMailboxMeshXBits) | boxX;
-              threadId = (threadId << (TinselLogCoresPerMailbox +
-                            TinselLogThreadsPerCore)) | threadNum;
-
-              // Get subgraph
+              uint32_t threadId = toThreadId(boardX, boardY,
+                                    boxX, boxY, threadNum);
               Graph* g = &threads.subgraphs[threadNum];
-
-              // Populate fromDeviceAddr mapping
-              uint32_t numDevs = g->incoming->numElems;
-              numDevicesOnThread[threadId] = numDevs;
-              fromDeviceAddr[threadId] = (PDeviceId*)
-                malloc(sizeof(PDeviceId) * numDevs);
-              for (uint32_t devNum = 0; devNum < numDevs; devNum++)
-                fromDeviceAddr[threadId][devNum] = g->labels->elems[devNum];
-  
-              // Populate toDeviceAddr mapping
-              assert(numDevs < maxLocalDeviceId());
-              for (uint32_t devNum = 0; devNum < numDevs; devNum++) {
-                PDeviceAddr devAddr =
-                  makeDeviceAddr(threadId, devNum);
-                toDeviceAddr[g->labels->elems[devNum]] = devAddr;
-              }
+              setThreadDevices(threadId, g->numNodes, g->labels->elems);
             }
           }
         }
       }
     }
+    *totalBoxesCost = boxesCost;
+  }
+
+  // Partition the graph between all threads in one go, then place
+  // hierarchically: consecutive partitions are grouped into mailboxes
+  // and boards (with METIS, these are subtrees of the recursive
+  // bisection), and the groups are placed using the connection counts
+  // between partitions, without computing any subgraphs
+  void placeFlat(uint64_t* boardsCost, uint64_t* totalBoxesCost) {
+    const uint32_t numBoards = numBoardsX * numBoardsY;
+    const uint32_t threadsPerBox = 1<<TinselLogThreadsPerMailbox;
+    const uint32_t boxesPerBoard =
+      TinselMailboxMeshXLen * TinselMailboxMeshYLen;
+    const uint32_t threadsPerBoard = threadsPerBox * boxesPerBoard;
+    const uint32_t numParts = numBoards * threadsPerBoard;
+
+    // Partition into one partition per thread
+    Placer threads(&graph, numParts, 1, maxDevicesPerThread(),
+      perDevice(deviceWeights), perDevice(messageRates), false);
+
+    // Place boards onto 2D mesh
+    Placer boards(&threads, numBoardsX, numBoardsY, threadsPerBoard, 0);
+    boards.place(placerEffort);
+    *boardsCost = boards.currentCost;
+
+    // Place mailboxes of each board
+    Placer** boxes = new Placer* [numBoards];
+    uint64_t boxesCost = 0;
+    #pragma omp parallel for reduction(+:boxesCost)
+    for (uint32_t b = 0; b < numBoards; b++) {
+      boxes[b] = new Placer(&threads, TinselMailboxMeshXLen,
+                   TinselMailboxMeshYLen, threadsPerBox, b * boxesPerBoard);
+      // Share the annealer's time budget between the boards
+      boxes[b]->annealTime = boards.annealTime * omp_get_num_threads() /
+                               numBoards;
+      boxes[b]->place(placerEffort);
+      boxesCost += boxes[b]->currentCost;
+    }
+    *totalBoxesCost = boxesCost;
+
+    // Group devices by partition
+    uint64_t* offsets = new uint64_t [numParts+1];
+    PDeviceId* ids = new PDeviceId [numDevices];
+    for (uint32_t p = 0; p <= numParts; p++) offsets[p] = 0;
+    for (PDeviceId id = 0; id < numDevices; id++)
+      offsets[threads.partitions[id]+1]++;
+    for (uint32_t p = 0; p < numParts; p++) offsets[p+1] += offsets[p];
+    for (PDeviceId id = 0; id < numDevices; id++)
+      ids[offsets[threads.partitions[id]]++] = id;
+    for (uint32_t p = numParts; p > 0; p--) offsets[p] = offsets[p-1];
+    offsets[0] = 0;
+
+    // Map each partition's devices to its thread
+    #pragma omp parallel for
+    for (uint32_t p = 0; p < numParts; p++) {
+      uint32_t b = p / threadsPerBoard;
+      uint32_t box = (p / threadsPerBox) % boxesPerBoard;
+      uint32_t threadId = toThreadId(
+        boards.xCoord[b], boards.yCoord[b],
+        boxes[b]->xCoord[box], boxes[b]->yCoord[box], p % threadsPerBox);
+      setThreadDevices(threadId, offsets[p+1] - offsets[p], &ids[offsets[p]]);
+    }
+
+    // Release
+    for (uint32_t b = 0; b < numBoards; b++) delete boxes[b];
+    delete [] boxes;
+    delete [] offsets;
+    delete [] ids;
+  }
+
+  // Implement mapping to tinsel threads
+  void map() {
+    // Let's measure some times
+    struct timeval placementStart, placementFinish;
+    struct timeval routingStart, routingFinish;
+    struct timeval initStart, initFinish;
+
+    // Convert graph to CSR form, if not already done
+    freeze();
+
+    // Release all mapping and heap structures
+    releaseAll();
+
+    // Reallocate mapping structures
+    allocateMapping();
+
+    // Reuse cached mapping, if available
+    uint64_t key = 0;
+    if (mapCacheDir != NULL) {
+      gettimeofday(&placementStart, NULL);
+      key = mappingKey();
+      if (loadMapping(key)) {
+        gettimeofday(&initFinish, NULL);
+        if (chatty > 0) {
+          struct timeval diff;
+          timersub(&initFinish, &placementStart, &diff);
+          double duration = (double) diff.tv_sec +
+            (double) diff.tv_usec / 1000000.0;
+          printf("POLite mapper profile:\n");
+          printf("  Loaded cached mapping: %lfs\n", duration);
+        }
+        return;
+      }
+    }
+
+    // Start placement timer
+    gettimeofday(&placementStart, NULL);
+
+    // Partition and place
+    uint64_t boardsCost, boxesCost;
+    if (flatPlacement)
+      placeFlat(&boardsCost, &boxesCost);
+    else
+      placeHierarchical(&boardsCost, &boxesCost);
+    if (localityOrder) orderDevicesForLocality();
 
     // Stop placement timer and start routing timer
     gettimeofday(&placementFinish, NULL);
@@ -873,15 +2783,28 @@ template <typename DeviceType,
         (double) diff.tv_usec / 1000000.0;
       printf("POLite mapper profile:\n");
       printf("  Partitioning and placement: %lfs\n", duration);
+      printf("  Placement cost: boards %lu, mailboxes %lu\n",
+        boardsCost, boxesCost);
 
       timersub(&routingFinish, &routingStart, &diff);
       duration = (double) diff.tv_sec + (double) diff.tv_usec / 1000000.0;
       printf("  Routing table construction: %lfs\n", duration);
+      printf("  Routing keys shared: %lu local, %lu inter-board\n",
+        numSharedInKeys, numSharedRouterKeys);
+      printf("  Programmable router tables: %lu bytes\n",
+        progRouterTables->numBytes());
+      if (numBoardsX * numBoardsY > 1) reportLinkLoads();
 
       timersub(&initFinish, &initStart, &diff);
       duration = (double) diff.tv_sec + (double) diff.tv_usec / 1000000.0;
       printf("  Thread state initialisation: %lfs\n", duration);
     }
+
+    // Check routing tables, if requested
+    if (verifyRouting) verifyRoutingTables();
+
+    // Save mapping to cache
+    if (mapCacheDir != NULL) saveMapping(key);
   }
 
   // Constructor
@@ -903,13 +2826,20 @@ template <typename DeviceType,
   // Deconstructor
   ~PGraph() {
     releaseAll();
-    for (uint32_t i = 0; i < edgeLabels.numElems; i++)
-      delete edgeLabels.elems[i];
+    if (edgeLabelSeq != NULL) delete edgeLabelSeq;
+    if (edgeLabels != NULL) delete [] edgeLabels;
+    if (deviceWeights != NULL) delete deviceWeights;
+    if (messageRates != NULL) delete messageRates;
   }
 
   // Write partition to tinsel machine
+  // (Each core is sent a burst of messages in turn, so that the
+  // cores store their bursts in parallel)
   void writeRAM(HostLink* hostLink,
          uint8_t** heap, uint32_t* heapSize, uint32_t* heapBase) {
+    // Max number of words sent to a core per turn
+    const uint32_t burstWords = 16 << TinselLogWordsPerMsg;
+
     // Number of bytes written by each thread
     uint32_t* writeCount = (uint32_t*)
       calloc(TinselMaxThreads, sizeof(uint32_t));
@@ -926,8 +2856,8 @@ template <typename DeviceType,
     }
 
     // Initialise write addresses
-    for (int x = 0; x < meshLenX; x++)
-      for (int y = 0; y < meshLenY; y++)
+    for (uint32_t x = 0; x < meshLenX; x++)
+      for (uint32_t y = 0; y < meshLenY; y++)
         for (int c = 0; c < TinselCoresPerBoard; c++)
           hostLink->setAddr(x, y, c, heapBase[hostLink->toAddr(x, y, c, 0)]);
 
@@ -935,8 +2865,8 @@ template <typename DeviceType,
     uint32_t done = false;
     while (! done) {
       done = true;
-      for (int x = 0; x < meshLenX; x++) {
-        for (int y = 0; y < meshLenY; y++) {
+      for (uint32_t x = 0; x < meshLenX; x++) {
+        for (uint32_t y = 0; y < meshLenY; y++) {
           for (int c = 0; c < TinselCoresPerBoard; c++) {
             uint32_t t = threadCount[x][y][c];
             if (t < TinselThreadsPerCore) {
@@ -949,8 +2879,9 @@ template <typename DeviceType,
                   hostLink->setAddr(x, y, c,
                     heapBase[hostLink->toAddr(x, y, c, t+1)]);
               } else {
-                uint32_t send = min((heapSize[threadId] - written)>>2, 15);
-                hostLink->store(x, y, c, send,
+                uint32_t send =
+                  min((heapSize[threadId] - written)>>2, burstWords);
+                hostLink->storeBlock(x, y, c, send,
                   (uint32_t*) &heap[threadId][written]);
                 writeCount[threadId] = written + send * sizeof(uint32_t);
               }
@@ -987,6 +2918,7 @@ template <typename DeviceType,
     progRouterTables->write(hostLink);
     hostLink->flush();
     hostLink->useSendBuffer = useSendBufferOld;
+    memset(dirtyDevices, 0, numDevices * sizeof(bool));
 
     // Display time if chatty
     gettimeofday(&finish, NULL);
@@ -999,6 +2931,109 @@ template <typename DeviceType,
     }
   }
 
+  // Mark given device's state as changed, so that it is written by
+  // the next call to writeDirty() or restart()
+  inline void markDirty(PDeviceId id) {
+    assert(dirtyDevices != NULL && id < numDevices);
+    dirtyDevices[id] = true;
+  }
+
+  // Write the states of devices marked dirty to tinsel machine
+  // (Contiguous dirty devices on a thread are written as a single block)
+  void writeDirty(HostLink* hostLink) {
+    bool useSendBufferOld = hostLink->useSendBuffer;
+    hostLink->useSendBuffer = true;
+    for (uint32_t t = 0; t < TinselMaxThreads; t++) {
+      uint32_t x, y, c, thread;
+      hostLink->fromAddr(t, &x, &y, &c, &thread);
+      uint32_t numDevs = numDevicesOnThread[t];
+      uint32_t d = 0;
+      while (d < numDevs) {
+        if (! dirtyDevices[fromDeviceAddr[t][d]]) { d++; continue; }
+        uint32_t first = d;
+        while (d < numDevs && dirtyDevices[fromDeviceAddr[t][d]]) {
+          dirtyDevices[fromDeviceAddr[t][d]] = false;
+          d++;
+        }
+        uint32_t offset = first * sizeof(PState<S>);
+        uint32_t numBytes = (d - first) * sizeof(PState<S>);
+        hostLink->setAddr(x, y, c, vertexMemBase[t] + offset);
+        hostLink->storeBlock(x, y, c, numBytes >> 2,
+          (uint32_t*) &vertexMem[t][offset]);
+      }
+    }
+    hostLink->flush();
+    hostLink->useSendBuffer = useSendBufferOld;
+  }
+
+  // Return every thread to the boot loader, once the application has
+  // terminated, by sending each thread a message (see PThread::run())
+  // Each thread writes back its cache and acknowledges before returning.
+  // (Has no effect if the threads are already in the boot loader)
+  void stop(HostLink* hostLink) {
+    if (stopped) return;
+    // Messages to a thread are received in order, so the boot loader
+    // on thread 0 of each core sees only the messages that follow
+    uint32_t msg[1 << TinselLogWordsPerMsg];
+    memset(msg, 0, sizeof(msg));
+    bool useSendBufferOld = hostLink->useSendBuffer;
+    hostLink->useSendBuffer = true;
+    for (int x = 0; x < hostLink->meshXLen; x++)
+      for (int y = 0; y < hostLink->meshYLen; y++)
+        for (int c = 0; c < TinselCoresPerBoard; c++)
+          for (int t = 0; t < TinselThreadsPerCore; t++)
+            hostLink->send(hostLink->toAddr(x, y, c, t), 1, msg);
+    hostLink->flush();
+    hostLink->useSendBuffer = useSendBufferOld;
+    // Wait until every thread's cache has been written back
+    uint32_t numThreads = hostLink->meshXLen * hostLink->meshYLen *
+                            TinselThreadsPerBoard;
+    for (uint32_t i = 0; i < numThreads; i++) hostLink->recv(msg);
+    stopped = true;
+  }
+
+  // Restart the application on the tinsel machine, after writing the
+  // states of devices marked dirty, without rewriting the rest of the
+  // graph or reloading the code.  Only valid once the application has
+  // terminated, e.g. once the host has received its results.  As with
+  // boot(), use HostLink::go() to trigger execution.
+  void restart(HostLink* hostLink) {
+    stop(hostLink);
+    writeDirty(hostLink);
+    hostLink->startAll();
+    stopped = false;
+  }
+
+  // Read the states of all devices back from the tinsel machine into
+  // devices[], in place.  Only valid once the application has terminated
+  // and any messages it sent to the host have been received.
+  // (Each core's threads are read using a single round trip)
+  void readStates(HostLink* hostLink) {
+    stop(hostLink);
+    bool useSendBufferOld = hostLink->useSendBuffer;
+    hostLink->useSendBuffer = true;
+    for (uint32_t x = 0; x < meshLenX; x++) {
+      for (uint32_t y = 0; y < meshLenY; y++) {
+        for (uint32_t c = 0; c < TinselCoresPerBoard; c++) {
+          // Request vertex mem of each thread on core
+          uint32_t base = hostLink->toAddr(x, y, c, 0);
+          for (uint32_t t = base; t < base + TinselThreadsPerCore; t++) {
+            if (vertexMemSize[t] == 0) continue;
+            hostLink->setAddr(x, y, c, vertexMemBase[t]);
+            hostLink->loadRequest(x, y, c, vertexMemSize[t] >> 2);
+          }
+          // Receive responses, in the same order
+          for (uint32_t t = base; t < base + TinselThreadsPerCore; t++) {
+            if (vertexMemSize[t] == 0) continue;
+            hostLink->loadResponse(vertexMemSize[t] >> 2,
+              (uint32_t*) vertexMem[t]);
+          }
+        }
+      }
+    }
+    hostLink->useSendBuffer = useSendBufferOld;
+  }
+
   // Determine fan-in of given device
   uint32_t fanIn(PDeviceId id) {
     return graph.fanIn(id);
@@ -6,6 +6,9 @@
 #include <metis.h>
 #include <POLite/Graph.h>
 #include <queue>
+#include <vector>
+#include <algorithm>
+#include <math.h>
 #include <omp.h>
 
 typedef uint32_t PartitionId;
@@ -18,7 +21,9 @@ struct Placer {
     Metis,
     Random,
     Direct,
-    BFS
+    BFS,
+    Hypergraph,
+    Stream
   };
   const Method defaultMethod=Metis;
 
@@ -34,8 +39,13 @@ struct Placer {
   // Mapping from partition id to subgraph
   Graph* subgraphs;
 
-  // Stores the number of connections between each pair of partitions
-  uint64_t** connCount;
+  // Stores the number of connections between each pair of partitions,
+  // sparsely: the partitions connected to partition p, and the number
+  // of connections to each, are stored in connPart and connCount from
+  // index connOffsets[p] to connOffsets[p+1] (exclusive)
+  uint64_t* connOffsets;
+  PartitionId* connPart;
+  uint64_t* connCount;
 
   // Mapping from mesh coords to partition id
   PartitionId** mapping;
@@ -61,6 +71,33 @@ struct Placer {
   // Controls which strategy is used
   Method method = Default;
 
+  // Place using parallel tempering rather than local search?
+  bool anneal = false;
+
+  // Time budget for the annealer, in seconds
+  double annealTime = 0.5;
+
+  // Maximum number of nodes per partition (0 means no limit)
+  // (Respected by the streaming partitioner and hypergraph refinement)
+  uint64_t capacity;
+
+  // Weight of each node, and expected number of messages sent by each
+  // node, indexed by node label (NULL means unweighted)
+  // (Used to balance load by the METIS-based partitioners)
+  const uint32_t* nodeWeights;
+  const uint32_t* messageRates;
+
+  // Weight of given node, as seen by METIS
+  inline idx_t nodeWeight(NodeId n) {
+    uint32_t w = nodeWeights[graph->labels->elems[n]];
+    return w == 0 ? 1 : (idx_t) w;
+  }
+
+  // Expected number of messages sent by given node
+  inline idx_t messageRate(NodeId n) {
+    return (idx_t) messageRates[graph->labels->elems[n]];
+  }
+
   // Select placer method
   void chooseMethod()
   {
@@ -74,6 +111,12 @@ struct Placer {
         method=Direct;
       else if (!strcmp(e, "bfs"))
         method=BFS;
+      else if (!strcmp(e, "hypergraph"))
+        method=Hypergraph;
+      else if (!strcmp(e, "stream"))
+        method=Stream;
+      else if (!strcmp(e, "anneal"))
+        anneal=true;
       else if (!strcmp(e, "default") || *e == '\0')
         method=Default;
       else {
@@ -83,21 +126,21 @@ struct Placer {
     }
     if (method == Default)
       method = defaultMethod;
+    e = getenv("POLITE_ANNEAL_TIME");
+    if (e && atof(e) > 0) annealTime = atof(e);
   }
 
   // Partition the graph using Metis
   void partitionMetis() {
     // Compute total number of edges
-    uint32_t numEdges = 0;
-    for (uint32_t i = 0; i < graph->incoming->numElems; i++) {
-      numEdges += graph->incoming->elems[i]->numElems +
-                  graph->outgoing->elems[i]->numElems;
-    }
+    uint64_t numEdges = 2 * graph->numEdges;
 
     // Create Metis parameters
-    idx_t nvtxs = (idx_t) graph->incoming->numElems;
+    idx_t nvtxs = (idx_t) graph->numNodes;
     idx_t nparts = (idx_t) (width * height);
-    idx_t nconn = 1;
+    // With node weights, also balance the number of nodes per partition,
+    // so that no partition holds more nodes than fit on its threads
+    idx_t nconn = nodeWeights != NULL ? 2 : 1;
     idx_t objval;
 
     // If there are no vertices
@@ -105,14 +148,14 @@ struct Placer {
 
     // If there are more partitions than vertices
     if (nparts >= nvtxs) {
-      for (uint32_t i = 0; i < nvtxs; i++)
+      for (idx_t i = 0; i < nvtxs; i++)
         partitions[i] = i;
       return;
     }
 
     // If there is exactly one partition
     if (nparts == 1) {
-      for (uint32_t i = 0; i < nvtxs; i++)
+      for (idx_t i = 0; i < nvtxs; i++)
         partitions[i] = 0;
       return;
     }
@@ -121,17 +164,51 @@ struct Placer {
     idx_t* xadj = (idx_t*) calloc(nvtxs+1, sizeof(idx_t));
     idx_t* adjncy = (idx_t*) calloc(numEdges, sizeof(idx_t));
 
+    // Allocate Metis weights, if used
+    idx_t* vwgt = NULL;
+    idx_t* adjwgt = NULL;
+    if (nodeWeights != NULL) {
+      vwgt = (idx_t*) calloc(2 * nvtxs, sizeof(idx_t));
+      for (idx_t i = 0; i < nvtxs; i++) {
+        vwgt[2*i] = nodeWeight(i);
+        vwgt[2*i+1] = 1;
+      }
+    }
+    if (messageRates != NULL)
+      adjwgt = (idx_t*) calloc(numEdges, sizeof(idx_t));
+
     // Populate undirected adjacency matrix
-    uint32_t next = 0;
-    for (uint32_t i = 0; i < nvtxs; i++) {
+    // (An undirected edge is weighted by the number of messages sent
+    // along it in either direction, so that the weights are symmetric)
+    uint64_t next = 0;
+    for (idx_t i = 0; i < nvtxs; i++) {
       xadj[i] = next;
-      Seq<NodeId>* in = graph->incoming->elems[i];
-      Seq<NodeId>* out = graph->outgoing->elems[i];
-      for (uint32_t j = 0; j < in->numElems; j++)
-        adjncy[next++] = (idx_t) in->elems[j];
-      for (uint32_t j = 0; j < out->numElems; j++)
-        if (! in->member(out->elems[j]))
-          adjncy[next++] = (idx_t) out->elems[j];
+      NodeId* in = graph->incoming(i);
+      NodeId* out = graph->outgoing(i);
+      uint32_t numIn = graph->fanIn(i);
+      uint32_t numOut = graph->fanOut(i);
+      for (uint32_t j = 0; j < numIn; j++) {
+        if (adjwgt != NULL) {
+          bool member = false;
+          for (uint32_t k = 0; k < numOut && !member; k++)
+            member = out[k] == in[j];
+          idx_t w = messageRate(in[j]) + (member ? messageRate(i) : 0);
+          adjwgt[next] = w == 0 ? 1 : w;
+        }
+        adjncy[next++] = (idx_t) in[j];
+      }
+      for (uint32_t j = 0; j < numOut; j++) {
+        bool member = false;
+        for (uint32_t k = 0; k < numIn && !member; k++)
+          member = in[k] == out[j];
+        if (! member) {
+          if (adjwgt != NULL) {
+            idx_t w = messageRate(i);
+            adjwgt[next] = w == 0 ? 1 : w;
+          }
+          adjncy[next++] = (idx_t) out[j];
+        }
+      }
     }
     xadj[nvtxs] = (idx_t) next;
 
@@ -148,21 +225,26 @@ struct Placer {
     // METIS_PartGraphRecursive.
     int ret = METIS_PartGraphRecursive(
       &nvtxs, &nconn, xadj, adjncy,
-      NULL, NULL, NULL, &nparts, NULL, NULL, options, &objval, parts);
+      vwgt, NULL, adjwgt, &nparts, NULL, NULL, options, &objval, parts);
 
     // Populate result array
-    for (uint32_t i = 0; i < graph->incoming->numElems; i++)
+    for (uint32_t i = 0; i < graph->numNodes; i++)
       partitions[i] = (uint32_t) parts[i];
 
+    // Report any partition that holds more nodes than its capacity
+    checkCapacity("METIS");
+
     // Release Metis structures
     free(xadj);
     free(adjncy);
     free(parts);
+    if (vwgt != NULL) free(vwgt);
+    if (adjwgt != NULL) free(adjwgt);
   }
 
   // Partition the graph randomly
   void partitionRandom() {
-    uint32_t numVertices = graph->incoming->numElems;
+    uint32_t numVertices = graph->numNodes;
     uint32_t numParts = width * height;
 
     // Populate result array
@@ -173,7 +255,7 @@ struct Placer {
 
   // Partition the graph using direct mapping
   void partitionDirect() {
-    uint32_t numVertices = graph->incoming->numElems;
+    uint32_t numVertices = graph->numNodes;
     uint32_t numParts = width * height;
     uint32_t partSize = (numVertices + numParts) / numParts;
 
@@ -185,7 +267,7 @@ struct Placer {
 
   // Partition the graph using repeated BFS
   void partitionBFS() {
-    uint32_t numVertices = graph->incoming->numElems;
+    uint32_t numVertices = graph->numNodes;
     uint32_t numParts = width * height;
     uint32_t partSize = (numVertices + numParts) / numParts;
 
@@ -215,9 +297,9 @@ struct Placer {
             partitions[v] = nextPart;
             count++;
             // Add unvisited neighbours of v to the frontier
-            Seq<uint32_t>* dests = graph->outgoing->elems[v];
-            for (uint32_t i = 0; i < dests->numElems; i++) {
-              uint32_t w = dests->elems[i];
+            NodeId* dests = graph->outgoing(v);
+            for (uint32_t i = 0; i < graph->fanOut(v); i++) {
+              uint32_t w = dests[i];
               if (!seen[w]) frontier.push(w);
             }
           }
@@ -231,6 +313,285 @@ struct Placer {
     delete [] seen;
   }
 
+  // Partition the graph in a small number of streaming passes over the
+  // nodes (Fennel), without building any further copy of the graph.
+  // Each node is assigned to the partition maximising the number of its
+  // neighbours already there, minus a penalty growing with partition
+  // size.  Later passes reassign each node given the full partitioning.
+  // Threads stream disjoint chunks of nodes concurrently, sharing the
+  // partition sizes and assignments.
+  void partitionStream() {
+    uint32_t numVertices = graph->numNodes;
+    uint32_t numParts = width * height;
+    const uint32_t numPasses = 2;
+    const uint32_t maxScan = 64;
+    const PartitionId unassigned = ~0;
+    if (numVertices == 0) return;
+
+    // Limit on partition size: slack of 10% over perfect balance,
+    // and no more than capacity (unless the nodes wouldn't fit)
+    uint64_t balanced = ((uint64_t) numVertices + numParts - 1) / numParts;
+    uint64_t maxSize = (uint64_t) (1.1 * numVertices / numParts) + 1;
+    if (capacity > 0 && capacity < maxSize) maxSize = capacity;
+    if (maxSize < balanced) maxSize = balanced;
+
+    // Fennel penalty: alpha * gamma * size^(gamma-1)
+    const double gamma = 1.5;
+    double alpha = sqrt((double) numParts) * (double) graph->numEdges /
+                     pow((double) numVertices, gamma);
+
+    uint64_t* size = new uint64_t [numParts];
+    for (uint32_t p = 0; p < numParts; p++) size[p] = 0;
+    for (uint32_t i = 0; i < numVertices; i++) partitions[i] = unassigned;
+
+    for (uint32_t pass = 0; pass < numPasses; pass++) {
+      #pragma omp parallel
+      {
+        // Number of neighbours of current node in each partition,
+        // and the partitions with non-zero counts
+        uint32_t* count = new uint32_t [numParts];
+        for (uint32_t p = 0; p < numParts; p++) count[p] = 0;
+        PartitionId* touched = new PartitionId [numParts];
+        uint32_t numTouched = 0;
+        unsigned int rng = seed + omp_get_thread_num();
+
+        #pragma omp for schedule(dynamic, 4096)
+        for (uint32_t v = 0; v < numVertices; v++) {
+          // Count neighbours in each partition
+          NodeId* in = graph->incoming(v);
+          NodeId* out = graph->outgoing(v);
+          uint32_t numIn = graph->fanIn(v);
+          uint32_t numOut = graph->fanOut(v);
+          for (uint32_t j = 0; j < numIn + numOut; j++) {
+            NodeId w = j < numIn ? in[j] : out[j - numIn];
+            PartitionId p = __atomic_load_n(&partitions[w],
+                                            __ATOMIC_RELAXED);
+            if (p != unassigned && count[p]++ == 0)
+              touched[numTouched++] = p;
+          }
+          // Remove node from its partition, on later passes
+          PartitionId old = partitions[v];
+          if (old != unassigned)
+            __atomic_fetch_sub(&size[old], 1, __ATOMIC_RELAXED);
+          // Choose partition with highest score and room to spare,
+          // retrying if the partition fills up in the meantime.  Only
+          // partitions holding neighbours, and the smallest partition
+          // (the best of the rest), need be considered.  When there are
+          // many partitions, the smallest of a random sample is used.
+          PartitionId best;
+          for (;;) {
+            PartitionId smallest = unassigned;
+            uint64_t smallestSize = maxSize;
+            if (numParts > maxScan) {
+              for (uint32_t i = 0; i < maxScan; i++) {
+                PartitionId p = rand_r(&rng) % numParts;
+                uint64_t n = __atomic_load_n(&size[p], __ATOMIC_RELAXED);
+                if (n < smallestSize) { smallest = p; smallestSize = n; }
+              }
+            }
+            if (smallest == unassigned) {
+              for (uint32_t p = 0; p < numParts; p++) {
+                uint64_t n = __atomic_load_n(&size[p], __ATOMIC_RELAXED);
+                if (n < smallestSize) { smallest = p; smallestSize = n; }
+              }
+            }
+            if (smallest == unassigned) continue;
+            best = smallest;
+            double bestScore = -alpha * gamma * sqrt((double) smallestSize);
+            for (uint32_t i = 0; i < numTouched; i++) {
+              PartitionId p = touched[i];
+              uint64_t n = __atomic_load_n(&size[p], __ATOMIC_RELAXED);
+              if (n >= maxSize) continue;
+              double score = count[p] - alpha * gamma * sqrt((double) n);
+              if (score > bestScore) {
+                best = p;
+                bestScore = score;
+              }
+            }
+            if (__atomic_fetch_add(&size[best], 1,
+                  __ATOMIC_RELAXED) < maxSize) break;
+            __atomic_fetch_sub(&size[best], 1, __ATOMIC_RELAXED);
+          }
+          __atomic_store_n(&partitions[v], best, __ATOMIC_RELAXED);
+          // Reset counts
+          for (uint32_t i = 0; i < numTouched; i++) count[touched[i]] = 0;
+          numTouched = 0;
+        }
+
+        delete [] count;
+        delete [] touched;
+      }
+    }
+
+    delete [] size;
+  }
+
+  // Refine the partitioning to reduce the number of messages sent
+  // between partitions.  Each (node, pin) pair is modelled as a
+  // hyperedge (a net) containing the node and its destinations on that
+  // pin, since a multicast message is sent once to each partition
+  // containing a destination.  Nodes are repeatedly moved to the
+  // partition that most reduces the connectivity metric, the sum over
+  // nets of (number of partitions spanned - 1), subject to limits on
+  // the number of nodes and the total node weight of each partition.
+  void refineConnectivity() {
+    uint32_t numVertices = graph->numNodes;
+    uint32_t numParts = width * height;
+    if (numVertices == 0 || numParts < 2) return;
+
+    // Create nets, one per (node, pin) pair, removing duplicate members
+    std::vector<uint64_t> netOffsets;
+    std::vector<NodeId> netNodes;
+    std::vector<std::pair<PinId, NodeId>> out;
+    netOffsets.push_back(0);
+    for (uint32_t i = 0; i < numVertices; i++) {
+      out.clear();
+      for (uint32_t j = 0; j < graph->fanOut(i); j++)
+        out.push_back(std::make_pair(graph->pins(i)[j],
+                                     graph->outgoing(i)[j]));
+      std::sort(out.begin(), out.end());
+      uint32_t j = 0;
+      while (j < out.size()) {
+        uint64_t base = netNodes.size();
+        netNodes.push_back(i);
+        PinId p = out[j].first;
+        for (; j < out.size() && out[j].first == p; j++)
+          if (out[j].second != i && out[j].second != netNodes.back())
+            netNodes.push_back(out[j].second);
+        if (netNodes.size() - base > 1)
+          netOffsets.push_back(netNodes.size());
+        else
+          netNodes.resize(base);
+      }
+    }
+    uint32_t numNets = netOffsets.size() - 1;
+
+    // Nets containing each node
+    std::vector<uint64_t> nodeNetOffsets(numVertices+1, 0);
+    for (uint64_t k = 0; k < netNodes.size(); k++)
+      nodeNetOffsets[netNodes[k]+1]++;
+    for (uint32_t i = 0; i < numVertices; i++)
+      nodeNetOffsets[i+1] += nodeNetOffsets[i];
+    std::vector<uint32_t> nodeNets(netNodes.size());
+    std::vector<uint64_t> next(nodeNetOffsets.begin(), nodeNetOffsets.end()-1);
+    for (uint32_t n = 0; n < numNets; n++)
+      for (uint64_t k = netOffsets[n]; k < netOffsets[n+1]; k++)
+        nodeNets[next[netNodes[k]]++] = n;
+
+    // Number of members of each net in each partition it spans
+    std::vector<std::vector<std::pair<PartitionId, uint32_t>>> spans(numNets);
+    for (uint32_t n = 0; n < numNets; n++)
+      for (uint64_t k = netOffsets[n]; k < netOffsets[n+1]; k++)
+        addToSpan(spans[n], partitions[netNodes[k]], 1);
+
+    // Partition sizes and weights, and the limits on them: slack of 3%
+    // over perfect balance, or the largest partition METIS produced,
+    // but no more nodes than capacity
+    std::vector<uint32_t> size(numParts, 0);
+    std::vector<uint64_t> weight(numParts, 0);
+    uint64_t totalWeight = 0;
+    for (uint32_t i = 0; i < numVertices; i++) {
+      uint64_t w = nodeWeights != NULL ? nodeWeight(i) : 1;
+      size[partitions[i]]++;
+      weight[partitions[i]] += w;
+      totalWeight += w;
+    }
+    uint32_t maxSize = (uint32_t) ceil(1.03 * numVertices / numParts);
+    uint64_t maxWeight = (uint64_t) ceil(1.03 * totalWeight / numParts);
+    for (uint32_t p = 0; p < numParts; p++) {
+      if (size[p] > maxSize) maxSize = size[p];
+      if (weight[p] > maxWeight) maxWeight = weight[p];
+    }
+    if (capacity > 0 && capacity < maxSize) maxSize = (uint32_t) capacity;
+
+    // For each candidate partition, the number of the node's nets
+    // that already span it
+    std::vector<uint32_t> occ(numParts, 0);
+    std::vector<PartitionId> touched;
+
+    // Make passes over the nodes until little improvement is made
+    const uint32_t maxPasses = 16;
+    for (uint32_t pass = 0; pass < maxPasses; pass++) {
+      uint64_t moves = 0;
+      for (uint32_t v = 0; v < numVertices; v++) {
+        PartitionId from = partitions[v];
+        uint32_t deg = nodeNetOffsets[v+1] - nodeNetOffsets[v];
+        uint64_t w = nodeWeights != NULL ? nodeWeight(v) : 1;
+        // Gain from leaving current partition
+        int64_t leaveGain = 0;
+        touched.clear();
+        for (uint64_t k = nodeNetOffsets[v]; k < nodeNetOffsets[v+1]; k++) {
+          for (auto& s : spans[nodeNets[k]]) {
+            if (s.first == from) {
+              if (s.second == 1) leaveGain++;
+            }
+            else if (occ[s.first]++ == 0)
+              touched.push_back(s.first);
+          }
+        }
+        // Pick best destination
+        // (Moving to partition q costs one for each net not spanning q)
+        PartitionId to = from;
+        int64_t bestGain = 0;
+        for (PartitionId q : touched) {
+          int64_t gain = leaveGain - (int64_t) (deg - occ[q]);
+          bool fits = size[q] < maxSize && weight[q] + w <= maxWeight;
+          if (fits && (gain > bestGain ||
+                (gain == bestGain && to != from && q < to))) {
+            bestGain = gain;
+            to = q;
+          }
+          occ[q] = 0;
+        }
+        // Move node
+        if (to != from) {
+          for (uint64_t k = nodeNetOffsets[v]; k < nodeNetOffsets[v+1]; k++) {
+            addToSpan(spans[nodeNets[k]], from, -1);
+            addToSpan(spans[nodeNets[k]], to, 1);
+          }
+          partitions[v] = to;
+          size[from]--;
+          size[to]++;
+          weight[from] -= w;
+          weight[to] += w;
+          moves++;
+        }
+      }
+      if (moves * 1000 < numVertices) break;
+    }
+  }
+
+  // Report any partition that holds more nodes than its capacity
+  void checkCapacity(const char* who) {
+    if (capacity == 0) return;
+    uint32_t numParts = width * height;
+    uint64_t* size = (uint64_t*) calloc(numParts, sizeof(uint64_t));
+    for (uint32_t i = 0; i < graph->numNodes; i++) size[partitions[i]]++;
+    uint64_t maxSize = 0;
+    for (uint32_t p = 0; p < numParts; p++)
+      if (size[p] > maxSize) maxSize = size[p];
+    if (maxSize > capacity)
+      fprintf(stderr, "Placer: %s partition of %lu nodes exceeds "
+                      "capacity of %lu nodes\n", who, maxSize, capacity);
+    free(size);
+  }
+
+  // Add n to the count of given partition in the span of a net
+  inline void addToSpan(std::vector<std::pair<PartitionId, uint32_t>>& span,
+                          PartitionId p, int32_t n) {
+    for (uint32_t i = 0; i < span.size(); i++) {
+      if (span[i].first == p) {
+        span[i].second += n;
+        if (span[i].second == 0) {
+          span[i] = span.back();
+          span.pop_back();
+        }
+        return;
+      }
+    }
+    span.push_back(std::make_pair(p, (uint32_t) n));
+  }
+
   void partition()
   {
     switch(method){
@@ -247,6 +608,14 @@ struct Placer {
     case BFS:
       partitionBFS();
       break;
+    case Hypergraph:
+      partitionMetis();
+      refineConnectivity();
+      checkCapacity("refined");
+      break;
+    case Stream:
+      partitionStream();
+      break;
     }
   }
 
@@ -255,10 +624,10 @@ struct Placer {
     uint32_t numPartitions = width*height;
 
     // Create mapping from node id to subgraph node id
-    NodeId* mappedTo = new NodeId [graph->incoming->numElems];
+    NodeId* mappedTo = new NodeId [graph->numNodes];
 
     // Create subgraphs
-    for (uint32_t i = 0; i < graph->incoming->numElems; i++) {
+    for (uint32_t i = 0; i < graph->numNodes; i++) {
       // What parition is this node in?
       PartitionId p = partitions[i];
       // Add node to subgraph
@@ -268,16 +637,21 @@ struct Placer {
     }
 
     // Add edges to subgraphs
-    for (uint32_t i = 0; i < graph->incoming->numElems; i++) {
+    for (uint32_t i = 0; i < graph->numNodes; i++) {
       PartitionId p = partitions[i];
-      Seq<NodeId>* out = graph->outgoing->elems[i];
-      for (uint32_t j = 0; j < out->numElems; j++) {
-        NodeId neighbour = out->elems[j];
+      NodeId* out = graph->outgoing(i);
+      for (uint32_t j = 0; j < graph->fanOut(i); j++) {
+        NodeId neighbour = out[j];
         if (partitions[neighbour] == p)
-          subgraphs[p].addEdge(mappedTo[i], mappedTo[neighbour]);
+          subgraphs[p].addEdge(mappedTo[i], graph->pins(i)[j],
+            mappedTo[neighbour]);
       }
     }
 
+    // Convert subgraphs to CSR form
+    for (uint32_t p = 0; p < numPartitions; p++)
+      subgraphs[p].freeze();
+
     // Release mapping
     delete [] mappedTo;
   }
@@ -286,20 +660,81 @@ struct Placer {
   void computeInterPartitionCounts() {
     uint32_t numPartitions = width*height;
 
-    // Zero the counts
-    for (uint32_t i = 0; i < numPartitions; i++)
-      for (uint32_t j = 0; j < numPartitions; j++)
-        connCount[i][j] = 0;
+    // Group nodes by partition
+    uint64_t* memberOffsets = new uint64_t [numPartitions+1];
+    NodeId* members = new NodeId [graph->numNodes];
+    for (uint32_t p = 0; p <= numPartitions; p++) memberOffsets[p] = 0;
+    for (uint32_t i = 0; i < graph->numNodes; i++)
+      memberOffsets[partitions[i]+1]++;
+    for (uint32_t p = 0; p < numPartitions; p++)
+      memberOffsets[p+1] += memberOffsets[p];
+    for (uint32_t i = 0; i < graph->numNodes; i++)
+      members[memberOffsets[partitions[i]]++] = i;
+    for (uint32_t p = numPartitions; p > 0; p--)
+      memberOffsets[p] = memberOffsets[p-1];
+    memberOffsets[0] = 0;
+
+    // Count connections of each partition, using a dense array of counts
+    // per host thread, and record the non-zero counts
+    PartitionId** rowPart = new PartitionId* [numPartitions];
+    uint64_t** rowCount = new uint64_t* [numPartitions];
+    uint32_t* rowLen = new uint32_t [numPartitions];
+    #pragma omp parallel
+    {
+      uint64_t* count = new uint64_t [numPartitions];
+      PartitionId* touched = new PartitionId [numPartitions];
+      for (uint32_t q = 0; q < numPartitions; q++) count[q] = 0;
+      #pragma omp for schedule(dynamic)
+      for (uint32_t p = 0; p < numPartitions; p++) {
+        uint32_t numTouched = 0;
+        for (uint64_t m = memberOffsets[p]; m < memberOffsets[p+1]; m++) {
+          NodeId i = members[m];
+          NodeId* in = graph->incoming(i);
+          NodeId* out = graph->outgoing(i);
+          for (uint32_t j = 0; j < graph->fanIn(i); j++) {
+            PartitionId q = partitions[in[j]];
+            if (count[q]++ == 0) touched[numTouched++] = q;
+          }
+          for (uint32_t j = 0; j < graph->fanOut(i); j++) {
+            PartitionId q = partitions[out[j]];
+            if (count[q]++ == 0) touched[numTouched++] = q;
+          }
+        }
+        std::sort(touched, touched + numTouched);
+        rowLen[p] = numTouched;
+        rowPart[p] = new PartitionId [numTouched];
+        rowCount[p] = new uint64_t [numTouched];
+        for (uint32_t k = 0; k < numTouched; k++) {
+          rowPart[p][k] = touched[k];
+          rowCount[p][k] = count[touched[k]];
+          count[touched[k]] = 0;
+        }
+      }
+      delete [] count;
+      delete [] touched;
+    }
 
-    // Iterative over graph and count connections
-    for (uint32_t i = 0; i < graph->incoming->numElems; i++) {
-      Seq<NodeId>* in = graph->incoming->elems[i];
-      Seq<NodeId>* out = graph->outgoing->elems[i];
-      for (uint32_t j = 0; j < in->numElems; j++)
-        connCount[partitions[i]][partitions[in->elems[j]]]++;
-      for (uint32_t j = 0; j < out->numElems; j++)
-        connCount[partitions[i]][partitions[out->elems[j]]]++;
+    // Pack rows
+    connOffsets[0] = 0;
+    for (uint32_t p = 0; p < numPartitions; p++)
+      connOffsets[p+1] = connOffsets[p] + rowLen[p];
+    connPart = new PartitionId [connOffsets[numPartitions]];
+    connCount = new uint64_t [connOffsets[numPartitions]];
+    for (uint32_t p = 0; p < numPartitions; p++) {
+      for (uint32_t k = 0; k < rowLen[p]; k++) {
+        connPart[connOffsets[p] + k] = rowPart[p][k];
+        connCount[connOffsets[p] + k] = rowCount[p][k];
+      }
+      delete [] rowPart[p];
+      delete [] rowCount[p];
     }
+
+    // Release
+    delete [] rowPart;
+    delete [] rowCount;
+    delete [] rowLen;
+    delete [] members;
+    delete [] memberOffsets;
   }
 
   // Create random mapping between partitions and mesh
@@ -348,23 +783,55 @@ struct Placer {
     }
   }
 
+  // Manhattan distance between mesh positions of two partitions,
+  // given mapping from partition id to mesh coords
+  inline uint32_t dist(uint32_t* xs, uint32_t* ys,
+                         PartitionId p, PartitionId q) {
+    uint32_t xDist = xs[p] >= xs[q] ? xs[p] - xs[q] : xs[q] - xs[p];
+    uint32_t yDist = ys[p] >= ys[q] ? ys[p] - ys[q] : ys[q] - ys[p];
+    return xDist + yDist;
+  }
+
+  // Manhattan distance between mesh positions of two partitions
+  inline uint32_t dist(PartitionId p, PartitionId q) {
+    return dist(xCoord, yCoord, p, q);
+  }
+
   // Cost function
   // Sum of products of manhatten distance and connection count
   uint64_t cost() {
     uint64_t total = 0;
     uint32_t numPartitions = width*height;
     for (uint32_t i = 0; i < numPartitions; i++) {
-      for (uint32_t j = 0; j < i; j++) {
-        uint32_t xDist = xCoord[i] >= xCoord[j] ?
-                           xCoord[i] - xCoord[j] : xCoord[j] - xCoord[i];
-        uint32_t yDist = yCoord[i] >= yCoord[j] ?
-                           yCoord[i] - yCoord[j] : yCoord[j] - yCoord[i];
-        total += ((uint64_t) (xDist + yDist)) * connCount[i][j];
+      for (uint64_t k = connOffsets[i]; k < connOffsets[i+1]; k++) {
+        PartitionId j = connPart[k];
+        if (j < i) total += ((uint64_t) dist(i, j)) * connCount[k];
       }
     }
     return total;
   }
 
+  // Change in cost if partition p were moved to the mesh position of
+  // partition q, ignoring the connections between p and q
+  int64_t moveCost(uint32_t* xs, uint32_t* ys,
+                     PartitionId p, PartitionId q) {
+    int64_t delta = 0;
+    for (uint64_t k = connOffsets[p]; k < connOffsets[p+1]; k++) {
+      PartitionId r = connPart[k];
+      if (r == p || r == q) continue;
+      int64_t before = dist(xs, ys, p, r);
+      int64_t after = dist(xs, ys, q, r);
+      delta += (after - before) * (int64_t) connCount[k];
+    }
+    return delta;
+  }
+
+  // Change in cost if partitions p and q were to swap mesh positions
+  inline int64_t swapCost(uint32_t* xs, uint32_t* ys,
+                            PartitionId p, PartitionId q) {
+    return moveCost(xs, ys, p, q) + moveCost(xs, ys, q, p);
+  }
+
   // Swap two mesh nodes
   inline void swap(uint32_t x, uint32_t y, uint32_t xNew, uint32_t yNew) {
     PartitionId p = mapping[y][x];
@@ -378,44 +845,52 @@ struct Placer {
   }
 
   // Swap two mesh nodes only if cost is reduced
+  // (The change in cost depends only on the connections of the two
+  // partitions being swapped, so is computed incrementally)
   bool trySwap(uint32_t x, uint32_t y, uint32_t xNew, uint32_t yNew) {
-    // Try swap
-    swap(x, y, xNew, yNew);
-    // Undo if cost not lowered
-    uint64_t c = cost();
-    if (c < currentCost) {
-      currentCost = c;
-      return true;
-    }
-    else {
+    PartitionId p = mapping[y][x];
+    PartitionId pNew = mapping[yNew][xNew];
+    int64_t delta = swapCost(xCoord, yCoord, p, pNew);
+    if (delta < 0) {
       swap(x, y, xNew, yNew);
-      return false;
+      currentCost += delta;
+      return true;
     }
+    return false;
   }
 
-  // Very simple local search algorithm for placement
   // Repeatedly swap a mesh node with it's neighbour if it lowers cost
+  void localSearch() {
+    bool change;
+    do {
+      change = false;
+      // Loop over mesh
+      for (uint32_t y = 0; y < height-1; y++) {
+        for (uint32_t x = 0; x < width-1; x++) {
+          change = trySwap(x, y, x+1, y) ||
+                     trySwap(x, y, x, y+1) ||
+                       trySwap(x, y, x+1, y+1) ||
+                         change;
+        }
+      }
+    } while (change);
+  }
+
+  // Very simple local search algorithm for placement
+  // (Or parallel tempering, if selected)
   void place(uint32_t numAttempts) {
+    if (anneal) {
+      placeAnneal();
+      return;
+    }
+
     // Initialise best cost
     savedCost = ~0;
 
     for (uint32_t n = 0; n < numAttempts; n++) {
       randomPlacement();
       currentCost = cost();
-
-      bool change;
-      do {
-        change = false;
-        // Loop over mesh
-        for (uint32_t y = 0; y < height-1; y++) {
-          for (uint32_t x = 0; x < width-1; x++) {
-            change = trySwap(x, y, x+1, y) ||
-                       trySwap(x, y, x, y+1) ||
-                         trySwap(x, y, x+1, y+1) ||
-                           change;
-          }
-        }
-      } while (change);
+      localSearch();
 
       if (currentCost <= savedCost)
         save();
@@ -424,22 +899,185 @@ struct Placer {
     }
   }
 
-  // Constructor
-  Placer(Graph* g, uint32_t w, uint32_t h) {
-    graph = g;
+  // A copy of the placement, used for parallel tempering
+  struct Replica {
+    // Mapping from mesh position (y*width+x) to partition id, and back
+    PartitionId* at;
+    uint32_t* xs;
+    uint32_t* ys;
+    // Cost of placement
+    uint64_t cost;
+    // Best placement seen, and its cost
+    PartitionId* bestAt;
+    uint64_t bestCost;
+    // Random seed
+    unsigned int seed;
+  };
+
+  // Make random swaps to given replica at given temperature, each
+  // accepted with probability exp(-increase in cost / temperature)
+  void annealReplica(Replica* r, double temp, uint32_t numSteps) {
+    uint32_t numPositions = width*height;
+    for (uint32_t n = 0; n < numSteps; n++) {
+      uint32_t i = rand_r(&r->seed) % numPositions;
+      uint32_t j = rand_r(&r->seed) % numPositions;
+      if (i == j) continue;
+      PartitionId p = r->at[i];
+      PartitionId q = r->at[j];
+      int64_t delta = swapCost(r->xs, r->ys, p, q);
+      if (delta > 0) {
+        double u = (double) rand_r(&r->seed) / ((double) RAND_MAX + 1.0);
+        if (u >= exp(-delta / temp)) continue;
+      }
+      r->at[i] = q;
+      r->at[j] = p;
+      std::swap(r->xs[p], r->xs[q]);
+      std::swap(r->ys[p], r->ys[q]);
+      r->cost += delta;
+      if (r->cost < r->bestCost) {
+        r->bestCost = r->cost;
+        for (uint32_t k = 0; k < numPositions; k++) r->bestAt[k] = r->at[k];
+      }
+    }
+  }
+
+  // Placement by parallel tempering: one replica of the placement per
+  // host thread, at geometrically spaced temperatures, makes random
+  // swaps, and replicas at adjacent temperatures periodically exchange
+  // placements.  All temperatures are lowered over the time budget.  The
+  // best placement seen is then improved further by local search.
+  void placeAnneal() {
+    uint32_t numPositions = width*height;
+    randomPlacement();
+    currentCost = cost();
+
+    // Initial temperature of coldest replica: mean magnitude of the
+    // change in cost due to a random swap
+    const uint32_t numSamples = 256;
+    double tMax = 0;
+    for (uint32_t n = 0; n < numSamples && numPositions > 1; n++) {
+      PartitionId p = getRand() % numPositions;
+      PartitionId q = getRand() % numPositions;
+      tMax += fabs((double) swapCost(xCoord, yCoord, p, q));
+    }
+    tMax = tMax / numSamples;
+    const double spread = 1000;
+    const double tMin = tMax / spread;
+
+    // Create replicas
+    uint32_t numReplicas = omp_in_parallel() ? 1 : omp_get_max_threads();
+    Replica* reps = new Replica [numReplicas];
+    // Ratio of each replica's temperature to the next coldest
+    // (The hottest replica is spread times hotter than the coldest)
+    double ratio = numReplicas > 1 ? pow(spread, 1.0/(numReplicas-1)) : 1;
+    for (uint32_t r = 0; r < numReplicas; r++) {
+      reps[r].at = new PartitionId [numPositions];
+      reps[r].bestAt = new PartitionId [numPositions];
+      reps[r].xs = new uint32_t [numPositions];
+      reps[r].ys = new uint32_t [numPositions];
+      for (uint32_t p = 0; p < numPositions; p++) {
+        reps[r].xs[p] = xCoord[p];
+        reps[r].ys[p] = yCoord[p];
+        reps[r].at[yCoord[p]*width + xCoord[p]] = p;
+        reps[r].bestAt[yCoord[p]*width + xCoord[p]] = p;
+      }
+      reps[r].cost = reps[r].bestCost = currentCost;
+      reps[r].seed = getRand();
+    }
+
+    // Anneal until time budget is used
+    const uint32_t stepsPerRound = 16 * numPositions;
+    double start = omp_get_wtime();
+    double elapsed = 0;
+    while (tMax > 0 && elapsed < annealTime) {
+      // Temperature of coldest replica
+      double temp = tMax * pow(tMin / tMax, elapsed / annealTime);
+      #pragma omp parallel for num_threads(numReplicas)
+      for (uint32_t r = 0; r < numReplicas; r++)
+        annealReplica(&reps[r], temp * pow(ratio, r), stepsPerRound);
+      // Exchange placements between adjacent replicas, with
+      // probability exp((1/temp_r - 1/temp_r+1) * (cost_r - cost_r+1))
+      for (uint32_t r = 0; r+1 < numReplicas; r++) {
+        double beta = (1 - 1 / ratio) / (temp * pow(ratio, r));
+        double e = beta * ((double) reps[r].cost - (double) reps[r+1].cost);
+        if (e >= 0 || (double) getRand() / ((double) RAND_MAX + 1.0) < exp(e))
+          std::swap(reps[r], reps[r+1]);
+      }
+      elapsed = omp_get_wtime() - start;
+    }
+
+    // Take the best placement seen by any replica
+    Replica* best = &reps[0];
+    for (uint32_t r = 1; r < numReplicas; r++)
+      if (reps[r].bestCost < best->bestCost) best = &reps[r];
+    for (uint32_t i = 0; i < numPositions; i++) {
+      PartitionId p = best->bestAt[i];
+      mapping[i / width][i % width] = p;
+      xCoord[p] = i % width;
+      yCoord[p] = i / width;
+    }
+    currentCost = cost();
+    localSearch();
+    save();
+
+    // Release replicas
+    for (uint32_t r = 0; r < numReplicas; r++) {
+      delete [] reps[r].at;
+      delete [] reps[r].bestAt;
+      delete [] reps[r].xs;
+      delete [] reps[r].ys;
+    }
+    delete [] reps;
+  }
+
+  // Count connections between groups of partitions of a finer placer,
+  // where partition p of the finer placer belongs to group
+  // p / groupSize - firstGroup (groups outside the mesh are ignored)
+  void computeGroupCounts(Placer* fine, uint32_t groupSize,
+                            uint32_t firstGroup) {
+    uint32_t numGroups = width*height;
+    uint64_t* count = new uint64_t [numGroups * numGroups];
+    for (uint64_t i = 0; i < (uint64_t) numGroups * numGroups; i++)
+      count[i] = 0;
+    PartitionId first = firstGroup * groupSize;
+    for (PartitionId p = first; p < first + numGroups * groupSize; p++) {
+      uint32_t g = p / groupSize - firstGroup;
+      for (uint64_t k = fine->connOffsets[p];
+             k < fine->connOffsets[p+1]; k++) {
+        uint32_t h = fine->connPart[k] / groupSize;
+        if (h >= firstGroup && h - firstGroup < numGroups)
+          count[g * numGroups + h - firstGroup] += fine->connCount[k];
+      }
+    }
+    // Record the non-zero counts
+    connOffsets[0] = 0;
+    for (uint32_t g = 0; g < numGroups; g++) {
+      connOffsets[g+1] = connOffsets[g];
+      for (uint32_t h = 0; h < numGroups; h++)
+        if (count[g * numGroups + h] > 0) connOffsets[g+1]++;
+    }
+    connPart = new PartitionId [connOffsets[numGroups]];
+    connCount = new uint64_t [connOffsets[numGroups]];
+    uint64_t next = 0;
+    for (uint32_t g = 0; g < numGroups; g++)
+      for (uint32_t h = 0; h < numGroups; h++)
+        if (count[g * numGroups + h] > 0) {
+          connPart[next] = h;
+          connCount[next++] = count[g * numGroups + h];
+        }
+    delete [] count;
+  }
+
+  // Allocate the connection counts and mesh mappings
+  void allocateMesh(uint32_t w, uint32_t h) {
     width = w;
     height = h;
     // Random seed
     setRand(1 + omp_get_thread_num());
-    // Allocate the partitions array
-    partitions = new PartitionId [g->incoming->numElems];
-    // Allocate subgraphs
-    subgraphs = new Graph [width*height];
-    // Allocate the connection count matrix
-    uint32_t numPartitions = width*height;
-    connCount = new uint64_t* [numPartitions];
-    for (uint32_t i = 0; i < numPartitions; i++)
-      connCount[i] = new uint64_t [numPartitions];
+    // Allocate the connection count offsets
+    connOffsets = new uint64_t [width*height+1];
+    connPart = NULL;
+    connCount = NULL;
     // Allocate mapping from mesh coords to partition id
     mapping = new PartitionId* [h];
     for (uint32_t i = 0; i < h; i++)
@@ -452,22 +1090,58 @@ struct Placer {
     yCoord = new uint32_t [width*height];
     xCoordSaved = new uint32_t [width*height];
     yCoordSaved = new uint32_t [width*height];
+  }
+
+  // Constructor
+  // (Optionally, with a maximum number of nodes per partition, and
+  // node weights and message rates indexed by node label.  Subgraphs
+  // are only computed if requested.)
+  Placer(Graph* g, uint32_t w, uint32_t h, uint64_t cap = 0,
+         const uint32_t* weights = NULL, const uint32_t* rates = NULL,
+         bool withSubgraphs = true) {
+    // The placer works on the CSR form of the graph
+    g->freeze();
+    graph = g;
+    capacity = cap;
+    nodeWeights = weights;
+    messageRates = rates;
+    // Allocate the partitions array
+    partitions = new PartitionId [g->numNodes];
+    // Allocate subgraphs
+    subgraphs = withSubgraphs ? new Graph [w*h] : NULL;
+    // Allocate connection counts and mappings
+    allocateMesh(w, h);
     // Pick a placement method, or select default
     chooseMethod();
     // Partition the graph using Metis
     partition();
     // Compute subgraphs, one per partition
-    computeSubgraphs();
+    if (withSubgraphs) computeSubgraphs();
     // Count connections between each pair of partitions
     computeInterPartitionCounts();
   }
 
+  // Constructor for placing groups of partitions of a finer placer onto
+  // a mesh, without a graph (see computeGroupCounts)
+  Placer(Placer* fine, uint32_t w, uint32_t h,
+           uint32_t groupSize, uint32_t firstGroup) {
+    graph = NULL;
+    capacity = 0;
+    nodeWeights = NULL;
+    messageRates = NULL;
+    partitions = NULL;
+    subgraphs = NULL;
+    allocateMesh(w, h);
+    chooseMethod();
+    computeGroupCounts(fine, groupSize, firstGroup);
+  }
+
   // Deconstructor
   ~Placer() {
     delete [] partitions;
     delete [] subgraphs;
-    uint32_t numPartitions = width*height;
-    for (uint32_t i = 0; i < numPartitions; i++) delete [] connCount[i];
+    delete [] connOffsets;
+    delete [] connPart;
     delete [] connCount;
     for (uint32_t i = 0; i < height; i++) delete [] mapping[i];
     delete [] mapping;
@@ -3,11 +3,14 @@
 #define _PROGROUTERS_H_
 
 #include <assert.h>
+#include <string.h>
 #include <config.h>
 #include <HostLink.h>
 #include <POLite.h>
 #include <POLite/Seq.h>
 #include <boot.h>
+#include <algorithm>
+#include <unordered_map>
 
 // =============================
 // Per-board programmable router
@@ -31,8 +34,8 @@ class ProgRouter {
   // (We need indirections to handle record sequences of 31 beats or more)
   uint8_t* prevInd;
 
-  // Move on to next the beat
-  void nextBeat() {
+  // Move on to the next beat, without adding an indirection
+  void closeBeat() {
     // Set number of records in current beat
     uint32_t beatBase = table[currentRAM]->numElems - 32;
     uint8_t* beat = &table[currentRAM]->elems[beatBase];
@@ -46,6 +49,13 @@ class ProgRouter {
       printf("ProgRouter out of memory\n");
       exit(EXIT_FAILURE);
     }
+    // Clear new beat, so that unused fields have a deterministic value
+    memset(&table[currentRAM]->elems[table[currentRAM]->numElems-32], 0, 32);
+  }
+
+  // Move on to the next beat
+  void nextBeat() {
+    closeBeat();
     // We need indirections to handle sequences of 31 beats or more
     if ((numBeats % 31) == 0) {
       // Set previous indirection, if there is one
@@ -92,6 +102,7 @@ class ProgRouter {
       table[i] = new Seq<uint8_t> (1 << 15);
       // Allocate first beat
       table[i]->extendBy(32);
+      memset(table[i]->elems, 0, 32);
     }
   }
 
@@ -121,7 +132,8 @@ class ProgRouter {
     if (currentRAM) key |= 0x80000000;
     key |= finalKeyLen;
     // Move to next beat
-    nextBeat();
+    // (The next key starts afresh, so needs no indirection yet)
+    closeBeat();
     numBeats = 1;
     prevInd = NULL;
     // Pick smaller RAM for next key
@@ -171,9 +183,12 @@ class ProgRouter {
   }
 
   // Add an RR record to the table
-  void addRR(uint32_t dir, uint32_t key) {
+  // Returns the location of the record, so the key can be set later
+  // using setRR() if it is not yet known
+  uint32_t addRR(uint32_t dir, uint32_t key) {
     if (numChunks == 5) nextBeat();
     uint8_t* ptr = currentRecord48();
+    uint32_t loc = (currentRAM << 31) | (ptr - table[currentRAM]->elems);
     ptr[0] = key;
     ptr[1] = key >> 8;
     ptr[2] = key >> 16;
@@ -181,6 +196,16 @@ class ProgRouter {
     ptr[5] = (2 << 5) | (dir << 3);
     numChunks++;
     numRecords++;
+    return loc;
+  }
+
+  // Set key of RR record at given location
+  void setRR(uint32_t loc, uint32_t key) {
+    uint8_t* ptr = &table[loc >> 31]->elems[loc & 0x7fffffff];
+    ptr[0] = key;
+    ptr[1] = key >> 8;
+    ptr[2] = key >> 16;
+    ptr[3] = key >> 24;
   }
 
   // Add a URM1 record to the table
@@ -258,6 +283,198 @@ inline uint32_t destMboxY(uint32_t mbox) {
            ((1<<TinselMailboxMeshYBits) - 1);
 }
 
+// Order routing destinations by kind, mailbox, and then record fields
+inline bool lessDest(const PRoutingDest& a, const PRoutingDest& b) {
+  if (a.kind != b.kind) return a.kind < b.kind;
+  if (a.mbox != b.mbox) return a.mbox < b.mbox;
+  if (a.kind == PRDestKindURM1) {
+    if (a.urm1.threadId != b.urm1.threadId)
+      return a.urm1.threadId < b.urm1.threadId;
+    return a.urm1.key < b.urm1.key;
+  }
+  if (a.mrm.key != b.mrm.key) return a.mrm.key < b.mrm.key;
+  if (a.mrm.threadMaskHigh != b.mrm.threadMaskHigh)
+    return a.mrm.threadMaskHigh < b.mrm.threadMaskHigh;
+  return a.mrm.threadMaskLow < b.mrm.threadMaskLow;
+}
+
+// Do two routing destinations produce the same record?
+inline bool sameDest(const PRoutingDest& a, const PRoutingDest& b) {
+  return !lessDest(a, b) && !lessDest(b, a);
+}
+
+// ==============================
+// Sharing keys between senders
+// ==============================
+
+// Memo of the destination sets routed from one board, so that senders
+// on the board with identical destination sets can share a routing key.
+// Sets are compared regardless of order, and each set is associated
+// with a value (e.g. its key) chosen by the caller.
+class ProgRouterKeyMemo {
+  // Sets with each hash
+  std::unordered_multimap<uint64_t, uint32_t> index;
+  // The destinations of set i, sorted, are stored in setDests from
+  // index setBase[i] onwards, and there are setSize[i] of them
+  Seq<uint32_t> setBase;
+  Seq<uint32_t> setSize;
+  Seq<uint64_t> setTag;
+  Seq<PRoutingDest> setDests;
+  // Temporary storage
+  Seq<PRoutingDest> sorted;
+
+ public:
+  // Value associated with each set
+  Seq<uint32_t> values;
+
+  // Find the set equal to the given one, with the same tag, adding it
+  // if there is none (in which case its value is zero and *added is set).
+  // Returns the index of the set.
+  uint32_t intern(Seq<PRoutingDest>* dests, bool* added, uint64_t tag = 0) {
+    uint32_t n = dests->numElems;
+    sorted.clear();
+    for (uint32_t i = 0; i < n; i++) sorted.append(dests->elems[i]);
+    std::sort(sorted.elems, sorted.elems + n, lessDest);
+    // Hash the tag and the record fields
+    uint64_t h = (n ^ tag) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 29;
+    for (uint32_t i = 0; i < n; i++) {
+      PRoutingDest* d = &sorted.elems[i];
+      uint64_t w[3] = { d->mbox, d->kind, 0 };
+      if (d->kind == PRDestKindURM1) {
+        w[1] |= (uint64_t) d->urm1.threadId << 32;
+        w[2] = d->urm1.key;
+      }
+      else {
+        w[1] |= (uint64_t) d->mrm.key << 32;
+        w[2] = ((uint64_t) d->mrm.threadMaskHigh << 32) |
+                 d->mrm.threadMaskLow;
+      }
+      for (uint32_t j = 0; j < 3; j++) {
+        h = (h ^ w[j]) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+      }
+    }
+    // Look for an equal set
+    auto range = index.equal_range(h);
+    for (auto it = range.first; it != range.second; it++) {
+      uint32_t set = it->second;
+      if (setSize.elems[set] != n || setTag.elems[set] != tag) continue;
+      PRoutingDest* other = &setDests.elems[setBase.elems[set]];
+      uint32_t i = 0;
+      while (i < n && sameDest(sorted.elems[i], other[i])) i++;
+      if (i == n) {
+        *added = false;
+        return set;
+      }
+    }
+    // Add new set
+    uint32_t set = values.numElems;
+    setBase.append(setDests.numElems);
+    setSize.append(n);
+    setTag.append(tag);
+    for (uint32_t i = 0; i < n; i++) setDests.append(sorted.elems[i]);
+    values.append(0);
+    index.emplace(h, set);
+    *added = true;
+    return set;
+  }
+};
+
+// ===========================
+// Deferred routing-table jobs
+// ===========================
+
+// A job adds a sequence of records to one board's table and generates
+// a key for them.  Jobs are planned independently (e.g. by different
+// host threads), then executed board-by-board, so that the tables for
+// different boards can be filled in parallel.
+struct ProgRouterJob {
+  // Board whose table holds the records
+  uint32_t boardX, boardY;
+  // Job receiving messages forwarded north, south, east, and west
+  // (Index into the plan's job sequence, or -1 if none)
+  int32_t next[4];
+  // Location of the RR record for each direction (set on execution)
+  uint32_t rrLoc[4];
+  // Local destinations (range of the plan's dest sequence)
+  uint32_t destsBase;
+  uint32_t numDests;
+  // Generated key (set on execution)
+  uint32_t key;
+};
+
+// A sequence of jobs, in the same order that the keys would be generated
+// by ProgRouterMesh::addDestsFromBoard()
+struct ProgRouterPlan {
+  // Jobs
+  Seq<ProgRouterJob> jobs;
+  // Local destinations of each job
+  Seq<PRoutingDest> dests;
+  // Temporary storage used during planning
+  Seq<PRoutingDest> scratch;
+};
+
+// ===============================
+// Deliveries made by ProgRouters
+// ===============================
+
+// A message delivered to a mailbox by a programmable router
+struct ProgRouterDelivery {
+  // Destination mailbox (global id)
+  uint32_t mbox;
+  // Destination threads
+  uint32_t threadMaskLow;
+  uint32_t threadMaskHigh;
+  // Local key, written over the start of the message
+  uint64_t key;
+  // Number of bytes of the message overwritten by the local key
+  uint32_t keyBytes;
+};
+
+// A routing key lookup still to be simulated
+struct ProgRouterLookup {
+  // Board on which the lookup happens
+  uint32_t boardX;
+  uint32_t boardY;
+  // Routing key
+  uint32_t key;
+  // Number of inter-board links crossed so far
+  uint32_t hops;
+  // Have all links crossed so far been westward?
+  bool westOnly;
+};
+
+// Read little-endian words from a routing record
+inline uint32_t recordWord(uint8_t* ptr) {
+  return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t) ptr[3] << 24);
+}
+
+// ======================================
+// Search for the smallest multicast tree
+// ======================================
+
+// Sets of boards are held in 64-bit masks
+static_assert((1 << (TinselMeshXBits + TinselMeshYBits)) <= 64,
+  "ProgRouters: board mesh too large for 64-bit board sets");
+
+// State of the search made by ProgRouterMesh::minLinkBranching().  A
+// branch of a multicast tree heading east from board (x, y) can reach
+// the destinations in columns x onwards (region 0) or, once it has
+// turned north or south, only those that are also in rows y onwards
+// (region 1) or rows up to y (region 2).
+struct ProgRouterBranching {
+  // Destination boards (bit y*boardsX+x is set for board (x, y))
+  uint64_t boards;
+  // Boards in each column and row
+  uint64_t col[1 << TinselMeshXBits];
+  uint64_t row[1 << TinselMeshYBits];
+  // Fewest links needed to reach the destinations in each region from
+  // each board (-1 if not yet known), and whether YX branching is used
+  int32_t cost[3][64];
+  bool yx[3][64];
+};
+
 // ============================
 // Mesh of programmable routers
 // ============================
@@ -276,14 +493,59 @@ class ProgRouterMesh {
     boardsX = numBoardsX;
     boardsY = numBoardsY;
     table = new ProgRouter* [numBoardsY];
-    for (int y = 0; y < numBoardsY; y++)
+    for (uint32_t y = 0; y < numBoardsY; y++)
       table[y] = new ProgRouter [numBoardsX];
   }
 
+  // Determine group of receiver board relative to sender board:
+  // 0 for local, or 1 + direction of RR record (N, S, E, W).
+  // Messages travel west, then east, then north or south (XY routing),
+  // or, if the sender board is in the set yx (bit y*boardsX+x is set
+  // for board (x, y)), west, then north or south, then east.  Both obey
+  // the west-first turn model, but the hardware only guarantees freedom
+  // from deadlock for dimension-ordered routing (see rtl/ProgRouter.bsv),
+  // so YX branching is experimental and unverified.
+  inline uint32_t category(uint32_t senderX, uint32_t senderY,
+                             uint32_t receiverX, uint32_t receiverY,
+                               uint64_t yx) {
+    bool branchYX = (yx >> (senderY*boardsX + senderX)) & 1;
+    if (receiverX < senderX) return 4;
+    if (receiverX > senderX && !branchYX) return 3;
+    if (receiverY < senderY) return 2;
+    if (receiverY > senderY) return 1;
+    if (receiverX > senderX) return 3;
+    return 0;
+  }
+
+  // Determine group of destination relative to sender board
+  inline uint32_t category(uint32_t senderX, uint32_t senderY,
+                             PRoutingDest* dest, uint64_t yx = 0) {
+    return category(senderX, senderY,
+             destX(dest->mbox), destY(dest->mbox), yx);
+  }
+
+  // Add a record for a board-local routing destination
+  void addLocalDest(ProgRouter* router, PRoutingDest* dest) {
+    if (dest->kind == PRDestKindMRM) {
+      router->addMRM(destMboxX(dest->mbox),
+        destMboxY(dest->mbox), dest->mrm.threadMaskHigh,
+        dest->mrm.threadMaskLow, dest->mrm.key);
+    }
+    else if (dest->kind == PRDestKindURM1) {
+      router->addURM1(destMboxX(dest->mbox),
+        destMboxY(dest->mbox), dest->urm1.threadId, dest->urm1.key);
+    }
+    else {
+      fprintf(stderr, "ProgRouters.h: unknown routing record kind\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
   // Add routing destinations from given sender board
+  // (Using YX rather than XY branching at the boards in the set yx)
   // Returns routing key
   uint32_t addDestsFromBoardXY(uint32_t senderX, uint32_t senderY,
-                                 Seq<PRoutingDest>* dests) {
+                                 Seq<PRoutingDest>* dests, uint64_t yx = 0) {
     if (dests->numElems == 0) return 0;
 
     // Categorise dests into local, N, S, E, and W groups
@@ -292,118 +554,499 @@ class ProgRouterMesh {
     Seq<PRoutingDest> south(dests->numElems);
     Seq<PRoutingDest> east(dests->numElems);
     Seq<PRoutingDest> west(dests->numElems);
+    Seq<PRoutingDest>* groups[] = { &local, &north, &south, &east, &west };
     for (int i = 0; i < dests->numElems; i++) {
       PRoutingDest dest = dests->elems[i];
-      uint32_t receiverX = destX(dest.mbox);
-      uint32_t receiverY = destY(dest.mbox);
-      if (receiverX < senderX) west.append(dest);
-      else if (receiverX > senderX) east.append(dest);
-      else if (receiverY < senderY) south.append(dest);
-      else if (receiverY > senderY) north.append(dest);
-      else local.append(dest);
+      groups[category(senderX, senderY, &dest, yx)]->append(dest);
     }
 
     // Recurse on non-local groups and add RR records on return
     if (north.numElems > 0) {
-      uint32_t key = addDestsFromBoardXY(senderX, senderY+1, &north);
+      uint32_t key = addDestsFromBoardXY(senderX, senderY+1, &north, yx);
       table[senderY][senderX].addRR(0, key);
     }
     if (south.numElems > 0) {
-      uint32_t key = addDestsFromBoardXY(senderX, senderY-1, &south);
+      uint32_t key = addDestsFromBoardXY(senderX, senderY-1, &south, yx);
       table[senderY][senderX].addRR(1, key);
     }
     if (east.numElems > 0) {
-      uint32_t key = addDestsFromBoardXY(senderX+1, senderY, &east);
+      uint32_t key = addDestsFromBoardXY(senderX+1, senderY, &east, yx);
       table[senderY][senderX].addRR(2, key);
     }
     if (west.numElems > 0) {
-      uint32_t key = addDestsFromBoardXY(senderX-1, senderY, &west);
+      uint32_t key = addDestsFromBoardXY(senderX-1, senderY, &west, yx);
       table[senderY][senderX].addRR(3, key);
     }
 
     // Add local records
-    for (int i = 0; i < local.numElems; i++) {
-      PRoutingDest dest = local.elems[i];
-      if (dest.kind == PRDestKindMRM) {
-        table[senderY][senderX].addMRM(destMboxX(dest.mbox),
-          destMboxY(dest.mbox), dest.mrm.threadMaskHigh,
-          dest.mrm.threadMaskLow, dest.mrm.key);
+    for (int i = 0; i < local.numElems; i++)
+      addLocalDest(&table[senderY][senderX], &local.elems[i]);
+
+    return table[senderY][senderX].genKey();
+  }
+
+  // Add routing destinations from given global mailbox id
+  uint32_t addDestsFromBoard(uint32_t mbox, Seq<PRoutingDest>* dests,
+                               uint64_t yx = 0) {
+    return addDestsFromBoardXY(destX(mbox), destY(mbox), dests, yx);
+  }
+
+  // Determine the inter-board links crossed by a message sent from the
+  // given board to the given set of boards (bit y*boardsX+x is set for
+  // board (x, y)), using the routes chosen by addDestsFromBoardXY().
+  // The link leaving board (x, y) in direction dir (as in RR records)
+  // is written to links as (y*boardsX + x)*4 + dir.
+  // Returns the number of links.
+  uint32_t routeLinks(uint32_t senderX, uint32_t senderY, uint64_t boards,
+                        uint64_t yx, uint32_t* links) {
+    uint32_t n = 0;
+    boards &= ~(1ull << (senderY*boardsX + senderX));
+    addRouteLinks(senderX, senderY, boards, yx, links, &n);
+    return n;
+  }
+
+  // Helper for routeLinks(): add links of the subtree rooted at the
+  // given board that reaches the given set of boards
+  void addRouteLinks(uint32_t senderX, uint32_t senderY, uint64_t boards,
+                       uint64_t yx, uint32_t* links, uint32_t* n) {
+    uint64_t groups[5] = { 0, 0, 0, 0, 0 };
+    for (uint64_t rest = boards; rest != 0; rest &= rest - 1) {
+      uint32_t b = __builtin_ctzll(rest);
+      groups[category(senderX, senderY, b % boardsX, b / boardsX, yx)] |=
+        1ull << b;
+    }
+    const int32_t dx[] = {0, 0, 1, -1};
+    const int32_t dy[] = {1, -1, 0, 0};
+    for (uint32_t dir = 0; dir < 4; dir++) {
+      if (groups[dir+1] == 0) continue;
+      links[(*n)++] = (senderY*boardsX + senderX)*4 + dir;
+      uint32_t x = senderX + dx[dir], y = senderY + dy[dir];
+      addRouteLinks(x, y, groups[dir+1] & ~(1ull << (y*boardsX + x)),
+        yx, links, n);
+    }
+  }
+
+  // Choose between XY and YX branching at each board of the multicast
+  // tree from the given sender board to the given set of boards (as in
+  // routeLinks()) so that the tree crosses as few inter-board links as
+  // possible.  Boards to the west are always reached by going west
+  // first, so only the branches heading east need be considered, and
+  // the destinations reachable from each of them form one of the
+  // regions described in ProgRouterBranching.  The best choice for
+  // each region and board is found by dynamic programming, preferring
+  // XY branching where the two are equally good.
+  // Returns the set of boards at which YX branching is used.
+  uint64_t minLinkBranching(uint32_t senderX, uint32_t senderY,
+                              uint64_t boards) {
+    ProgRouterBranching b;
+    b.boards = boards & ~(1ull << (senderY*boardsX + senderX));
+    for (uint32_t x = 0; x < boardsX; x++) b.col[x] = 0;
+    for (uint32_t y = 0; y < boardsY; y++) b.row[y] = 0;
+    for (uint32_t y = 0; y < boardsY; y++)
+      for (uint32_t x = 0; x < boardsX; x++) {
+        b.col[x] |= 1ull << (y*boardsX + x);
+        b.row[y] |= 1ull << (y*boardsX + x);
       }
-      else if (dest.kind == PRDestKindURM1) {
-        table[senderY][senderX].addURM1(destMboxX(dest.mbox),
-          destMboxY(dest.mbox), dest.urm1.threadId, dest.urm1.key);
+    for (uint32_t r = 0; r < 3; r++)
+      for (uint32_t i = 0; i < 64; i++) b.cost[r][i] = -1;
+    uint64_t yx = 0;
+    markBranching(&b, 0, senderY*boardsX + senderX, &yx);
+    return yx;
+  }
+
+  // Helper for minLinkBranching(): consider reaching the destinations
+  // in the given region from board (x, y) using XY or YX branching at
+  // the board.  Destinations in a straight line north, south, or east
+  // of the board, on which the branching makes no difference, are
+  // reached directly.  The other branches, each a (region, board) pair
+  // still to be searched, are written to next.  Returns the number of
+  // links used by the straight lines and by the first hop of each
+  // branch.
+  uint32_t branchStep(ProgRouterBranching* b, uint32_t region,
+                        uint32_t x, uint32_t y, bool yx,
+                          uint32_t* next, uint32_t* numNext) {
+    uint64_t east = 0, north = 0, south = 0;
+    for (uint32_t c = x+1; c < boardsX; c++) east |= b->col[c];
+    if (region != 2)
+      for (uint32_t r = y+1; r < boardsY; r++) north |= b->row[r];
+    if (region != 1)
+      for (uint32_t r = 0; r < y; r++) south |= b->row[r];
+    uint32_t links = 0;
+    *numNext = 0;
+    if (yx) {
+      // Straight line east
+      uint64_t line = b->boards & b->row[y] & east;
+      if (line != 0) links += (63 - __builtin_clzll(line)) % boardsX - x;
+      // Branches north and south
+      if (b->boards & (b->col[x] | east) & north) {
+        next[(*numNext)++] = (1 << 16) | ((y+1)*boardsX + x);
+        links++;
       }
-      else {
-        fprintf(stderr, "ProgRouters.h: unknown routing record kind\n");
-        exit(EXIT_FAILURE);
+      if (b->boards & (b->col[x] | east) & south) {
+        next[(*numNext)++] = (2 << 16) | ((y-1)*boardsX + x);
+        links++;
       }
     }
+    else {
+      // Straight lines north and south
+      uint64_t line = b->boards & b->col[x] & north;
+      if (line != 0) links += (63 - __builtin_clzll(line)) / boardsX - y;
+      line = b->boards & b->col[x] & south;
+      if (line != 0) links += y - __builtin_ctzll(line) / boardsX;
+      // Branch east
+      if (b->boards & east & (north | south | b->row[y])) {
+        next[(*numNext)++] = (region << 16) | (y*boardsX + x+1);
+        links++;
+      }
+    }
+    return links;
+  }
 
-    return table[senderY][senderX].genKey();
+  // Helper for minLinkBranching(): fewest links needed to reach the
+  // destinations in the given region from the given board
+  uint32_t branchCost(ProgRouterBranching* b, uint32_t region,
+                        uint32_t board) {
+    if (b->cost[region][board] >= 0) return b->cost[region][board];
+    uint32_t best = 0;
+    for (uint32_t yx = 0; yx < 2; yx++) {
+      uint32_t next[2], numNext;
+      uint32_t links = branchStep(b, region, board % boardsX,
+                         board / boardsX, yx, next, &numNext);
+      for (uint32_t i = 0; i < numNext; i++)
+        links += branchCost(b, next[i] >> 16, next[i] & 0xffff);
+      if (yx == 0 || links < best) {
+        best = links;
+        b->yx[region][board] = yx;
+      }
+    }
+    b->cost[region][board] = best;
+    return best;
   }
 
-  // Add routing destinations from given global mailbox id
-  uint32_t addDestsFromBoard(uint32_t mbox, Seq<PRoutingDest>* dests) {
-    return addDestsFromBoardXY(destX(mbox), destY(mbox), dests);
+  // Helper for minLinkBranching(): add the boards at which the best
+  // tree for the given region and board uses YX branching to the set yx
+  void markBranching(ProgRouterBranching* b, uint32_t region,
+                       uint32_t board, uint64_t* yx) {
+    branchCost(b, region, board);
+    bool branchYX = b->yx[region][board];
+    if (branchYX) *yx |= 1ull << board;
+    uint32_t next[2], numNext;
+    branchStep(b, region, board % boardsX, board / boardsX,
+      branchYX, next, &numNext);
+    for (uint32_t i = 0; i < numNext; i++)
+      markBranching(b, next[i] >> 16, next[i] & 0xffff, yx);
+  }
+
+  // Plan the jobs needed to reach the given destinations from the given
+  // sender board, without modifying any tables.  The destinations are
+  // taken from the plan's scratch sequence.  Returns index of the job
+  // on the sender board.  The job order and the records of each job
+  // match those of addDestsFromBoardXY().
+  int32_t planDestsFromBoardXY(uint32_t senderX, uint32_t senderY,
+                                 uint32_t base, uint32_t numDests,
+                                   ProgRouterPlan* plan, uint64_t yx = 0) {
+    // Categorise dests into local, N, S, E, and W groups, preserving
+    // order, in a fresh region at the top of the scratch sequence
+    uint32_t top = plan->scratch.numElems;
+    plan->scratch.extendBy(numDests);
+    PRoutingDest* scratch = plan->scratch.elems;
+    uint32_t count[5] = {0, 0, 0, 0, 0};
+    for (uint32_t i = 0; i < numDests; i++)
+      count[category(senderX, senderY, &scratch[base+i], yx)]++;
+    uint32_t start[5];
+    uint32_t next[5];
+    for (uint32_t c = 0, pos = top; c < 5; c++) {
+      start[c] = next[c] = pos;
+      pos += count[c];
+    }
+    for (uint32_t i = 0; i < numDests; i++) {
+      PRoutingDest* dest = &scratch[base+i];
+      scratch[next[category(senderX, senderY, dest, yx)]++] = *dest;
+    }
+
+    // Recurse on non-local groups
+    ProgRouterJob job;
+    job.boardX = senderX;
+    job.boardY = senderY;
+    const int32_t dx[] = {0, 0, 1, -1};
+    const int32_t dy[] = {1, -1, 0, 0};
+    for (uint32_t dir = 0; dir < 4; dir++) {
+      job.next[dir] = -1;
+      if (count[dir+1] > 0)
+        job.next[dir] = planDestsFromBoardXY(senderX + dx[dir],
+          senderY + dy[dir], start[dir+1], count[dir+1], plan, yx);
+    }
+
+    // Local destinations
+    job.destsBase = plan->dests.numElems;
+    job.numDests = count[0];
+    for (uint32_t i = 0; i < count[0]; i++)
+      plan->dests.append(plan->scratch.elems[start[0]+i]);
+    plan->jobs.append(job);
+
+    // Release scratch space
+    plan->scratch.numElems = top;
+    return plan->jobs.numElems-1;
+  }
+
+  // Plan the jobs needed to reach the given destinations from the given
+  // global mailbox id.  Returns index of the job whose key is to be used
+  // by the sender, or -1 if there are no destinations.
+  int32_t planDestsFromBoard(uint32_t mbox, Seq<PRoutingDest>* dests,
+                               ProgRouterPlan* plan, uint64_t yx = 0) {
+    if (dests->numElems == 0) return -1;
+    plan->scratch.clear();
+    for (int i = 0; i < dests->numElems; i++)
+      plan->scratch.append(dests->elems[i]);
+    return planDestsFromBoardXY(destX(mbox), destY(mbox),
+             0, dests->numElems, plan, yx);
+  }
+
+  // Execute given job, adding its records to its board's table
+  // (Jobs on the same board must be executed in order, but jobs on
+  // different boards may be executed in parallel)
+  void runJob(ProgRouterPlan* plan, uint32_t j) {
+    ProgRouterJob* job = &plan->jobs.elems[j];
+    ProgRouter* router = &table[job->boardY][job->boardX];
+    // RR records (keys are filled in later by patchJob())
+    for (uint32_t dir = 0; dir < 4; dir++)
+      if (job->next[dir] >= 0) job->rrLoc[dir] = router->addRR(dir, 0);
+    // Local records
+    for (uint32_t i = 0; i < job->numDests; i++)
+      addLocalDest(router, &plan->dests.elems[job->destsBase + i]);
+    job->key = router->genKey();
+  }
+
+  // Fill in the RR keys of an executed job
+  // (Only valid once all jobs in the plan have been executed)
+  void patchJob(ProgRouterPlan* plan, uint32_t j) {
+    ProgRouterJob* job = &plan->jobs.elems[j];
+    ProgRouter* router = &table[job->boardY][job->boardX];
+    for (uint32_t dir = 0; dir < 4; dir++)
+      if (job->next[dir] >= 0)
+        router->setRR(job->rrLoc[dir], plan->jobs.elems[job->next[dir]].key);
   }
 
   // Write routing tables to memory via HostLink
+  // (Each DRAM is sent a burst of messages in turn)
   void write(HostLink* hostLink) {
-    // Request to boot loader
-    BootReq req;
+    // Max number of bytes sent to a DRAM per turn
+    const uint32_t burstBytes = 64 << TinselLogBytesPerMsg;
 
     // Compute number of cores per DRAM
     const uint32_t coresPerDRAM = 1 <<
       (TinselLogCoresPerDCache + TinselLogDCachesPerDRAM);
 
     // Initialise write address for each routing table
-    for (int y = 0; y < boardsY; y++) {
-      for (int x = 0; x < boardsX; x++) {
-        for (int i = 0; i < TinselDRAMsPerBoard; i++) {
+    for (uint32_t y = 0; y < boardsY; y++)
+      for (uint32_t x = 0; x < boardsX; x++)
+        for (int i = 0; i < TinselDRAMsPerBoard; i++)
           // Use one core to initialise each DRAM
-          uint32_t dest = hostLink->toAddr(x, y, coresPerDRAM * i, 0);
-          req.cmd = SetAddrCmd;
-          req.numArgs = 1;
-          req.args[0] = TinselPOLiteProgRouterBase;
-          hostLink->send(dest, 1, &req);
-          // Ensure space for an extra 32 bytes in each 
-          // table so we don't have to check for overflow below
-          // when consuming the tables in chunks of 12 bytes
-          table[y][x].table[i]->ensureSpaceFor(32);
-        }
-      }
-    }
+          hostLink->setAddr(x, y, coresPerDRAM * i,
+            TinselPOLiteProgRouterBase);
 
     // Write each routing table
     bool allDone = false;
     uint32_t offset = 0;
     while (! allDone) {
       allDone = true;
-      for (int y = 0; y < boardsY; y++) {
-        for (int x = 0; x < boardsX; x++) {
+      for (uint32_t y = 0; y < boardsY; y++) {
+        for (uint32_t x = 0; x < boardsX; x++) {
           for (int i = 0; i < TinselDRAMsPerBoard; i++) {
             Seq<uint8_t>* seq = table[y][x].table[i];
-            if (offset < seq->numElems) {
-              uint32_t dest = hostLink->toAddr(x, y, coresPerDRAM * i, 0);
-              uint8_t* base = &seq->elems[offset];
+            if (offset < (uint32_t) seq->numElems) {
+              uint32_t bytes = seq->numElems - offset;
+              if (bytes > burstBytes) bytes = burstBytes;
               allDone = false;
-              req.cmd = StoreCmd;
-              req.numArgs = 3;
-              req.args[0] = ((uint32_t*) base)[0];
-              req.args[1] = ((uint32_t*) base)[1];
-              req.args[2] = ((uint32_t*) base)[2];
-              hostLink->send(dest, 1, &req);
+              hostLink->storeBlock(x, y, coresPerDRAM * i, bytes >> 2,
+                (uint32_t*) &seq->elems[offset]);
             }
           }
         }
       }
-      offset += 12;
+      offset += burstBytes;
+    }
+  }
+
+  // Save routing tables to file
+  // Returns false on error
+  bool save(FILE* fp) {
+    for (uint32_t y = 0; y < boardsY; y++)
+      for (uint32_t x = 0; x < boardsX; x++)
+        for (int i = 0; i < TinselDRAMsPerBoard; i++) {
+          Seq<uint8_t>* seq = table[y][x].table[i];
+          uint32_t n = seq->numElems;
+          if (fwrite(&n, sizeof(uint32_t), 1, fp) != 1) return false;
+          if (fwrite(seq->elems, 1, n, fp) != n) return false;
+        }
+    return true;
+  }
+
+  // Follow the given routing key from the given board, interpreting the
+  // records in the tables as rtl/ProgRouter.bsv does, and append the
+  // resulting deliveries, and the inter-board links crossed (encoded as
+  // in routeLinks()), to the given sequences.  The length of the longest
+  // route is written to maxHops.  Returns NULL if all is well, or else a
+  // description of the first problem found.  Besides being well formed,
+  // the tables must route each message to each board at most once, and
+  // must obey the west-first turn model, so as to be free of deadlock.
+  const char* simulate(uint32_t senderX, uint32_t senderY, uint32_t key,
+                         Seq<ProgRouterDelivery>* out, Seq<uint32_t>* links,
+                           uint32_t* maxHops) {
+    const uint32_t logMailboxesPerBoard =
+      TinselMailboxMeshXBits + TinselMailboxMeshYBits;
+    const int dx[] = { 0, 0, 1, -1 };
+    const int dy[] = { 1, -1, 0, 0 };
+    // Boards visited so far
+    Seq<bool> visited(boardsX * boardsY);
+    visited.extendBy(boardsX * boardsY);
+    for (uint32_t i = 0; i < boardsX * boardsY; i++)
+      visited.elems[i] = false;
+    visited.elems[senderY*boardsX + senderX] = true;
+    // Lookups still to do
+    Seq<ProgRouterLookup> todo(16);
+    ProgRouterLookup first;
+    first.boardX = senderX;
+    first.boardY = senderY;
+    first.key = key;
+    first.hops = 0;
+    first.westOnly = true;
+    todo.append(first);
+    *maxHops = 0;
+    while (todo.numElems > 0) {
+      ProgRouterLookup lookup = todo.elems[--todo.numElems];
+      if (lookup.hops > *maxHops) *maxHops = lookup.hops;
+      // Keys with zero beats are ignored
+      uint32_t numBeats = lookup.key & 0x1f;
+      if (numBeats == 0) continue;
+      // Locate the beats
+      Seq<uint8_t>* ram =
+        table[lookup.boardY][lookup.boardX].table[lookup.key >> 31];
+      uint32_t addr = lookup.key & 0x7fffffe0;
+      if (addr < TinselPOLiteProgRouterBase ||
+            addr - TinselPOLiteProgRouterBase + numBeats*32 >
+              (uint32_t) ram->numElems)
+        return "routing key refers to beats outside the table";
+      uint8_t* beat = &ram->elems[addr - TinselPOLiteProgRouterBase];
+      // Max-sized keys continue via exactly one IND record
+      uint32_t numInds = 0;
+      for (uint32_t b = 0; b < numBeats; b++, beat += 32) {
+        uint32_t numRecords = beat[30] | (beat[31] << 8);
+        if (numRecords == 0 || numRecords > 5)
+          return "routing beat has invalid record count";
+        // The first record occupies the most-significant chunk
+        int chunk = 4;
+        for (uint32_t r = 0; r < numRecords; r++) {
+          if (chunk < 0) return "routing records overflow beat";
+          uint32_t tag = beat[6*chunk + 5] >> 5;
+          // URM2 and MRM records occupy two chunks
+          bool wide = tag == 1 || tag == 3;
+          if (wide && chunk < 1) return "routing records overflow beat";
+          uint8_t* rec = &beat[6*(wide ? chunk-1 : chunk)];
+          chunk -= wide ? 2 : 1;
+          ProgRouterDelivery del;
+          uint32_t mbox = (rec[wide ? 11 : 5] >> 1) & 0xf;
+          uint32_t thread = ((rec[wide ? 11 : 5] & 1) << 5) |
+                              (rec[wide ? 10 : 4] >> 3);
+          del.mbox = (((lookup.boardY << TinselMeshXBits) | lookup.boardX)
+                       << logMailboxesPerBoard) | mbox;
+          del.threadMaskLow = thread < 32 ? 1u << thread : 0;
+          del.threadMaskHigh = thread < 32 ? 0 : 1u << (thread-32);
+          if (tag == 0) {
+            // URM1
+            del.key = recordWord(rec);
+            del.keyBytes = 4;
+            out->append(del);
+          }
+          else if (tag == 1) {
+            // URM2
+            del.key = recordWord(rec) |
+                        ((uint64_t) recordWord(rec+4) << 32);
+            del.keyBytes = 8;
+            out->append(del);
+          }
+          else if (tag == 2) {
+            // RR
+            uint32_t dir = (rec[5] >> 3) & 3;
+            int nx = (int) lookup.boardX + dx[dir];
+            int ny = (int) lookup.boardY + dy[dir];
+            if (nx < 0 || nx >= (int) boardsX ||
+                  ny < 0 || ny >= (int) boardsY)
+              return "route leaves the board mesh";
+            if (dir == 3 && !lookup.westOnly)
+              return "route turns west (violating west-first routing)";
+            if (visited.elems[ny*boardsX + nx])
+              return "route reaches a board more than once";
+            visited.elems[ny*boardsX + nx] = true;
+            links->append((lookup.boardY*boardsX + lookup.boardX)*4 + dir);
+            ProgRouterLookup next;
+            next.boardX = nx;
+            next.boardY = ny;
+            next.key = recordWord(rec);
+            next.hops = lookup.hops + 1;
+            next.westOnly = lookup.westOnly && dir == 3;
+            todo.append(next);
+          }
+          else if (tag == 3) {
+            // MRM
+            del.threadMaskLow = recordWord(rec);
+            del.threadMaskHigh = recordWord(rec+4);
+            del.key = rec[8] | (rec[9] << 8);
+            del.keyBytes = 2;
+            out->append(del);
+          }
+          else if (tag == 4) {
+            // IND
+            if (numBeats != 31)
+              return "indirection in routing key that is not max-sized";
+            if (++numInds > 1)
+              return "more than one indirection in routing key";
+            ProgRouterLookup next = lookup;
+            next.key = recordWord(rec);
+            todo.append(next);
+          }
+          else
+            return "unknown routing record type";
+        }
+      }
+      if (numBeats == 31 && numInds == 0)
+        return "max-sized routing key lacks an indirection";
     }
+    return NULL;
+  }
+
+  // Total size of the tables, in bytes
+  uint64_t numBytes() {
+    uint64_t n = 0;
+    for (uint32_t y = 0; y < boardsY; y++)
+      for (uint32_t x = 0; x < boardsX; x++)
+        for (int i = 0; i < TinselDRAMsPerBoard; i++)
+          n += table[y][x].table[i]->numElems;
+    return n;
+  }
+
+  // Load routing tables previously saved using save()
+  // (No further records can be added to loaded tables)
+  // Returns false on error
+  bool load(FILE* fp) {
+    for (uint32_t y = 0; y < boardsY; y++)
+      for (uint32_t x = 0; x < boardsX; x++)
+        for (int i = 0; i < TinselDRAMsPerBoard; i++) {
+          Seq<uint8_t>* seq = table[y][x].table[i];
+          uint32_t n;
+          if (fread(&n, sizeof(uint32_t), 1, fp) != 1) return false;
+          if (n >= TinselPOLiteProgRouterLength) return false;
+          seq->clear();
+          seq->ensureSpaceFor(n);
+          seq->numElems = n;
+          if (fread(seq->elems, 1, n, fp) != n) return false;
+        }
+    return true;
   }
 
   // Destructor
   ~ProgRouterMesh() {
-     for (int y = 0; y < boardsY; y++)
+     for (uint32_t y = 0; y < boardsY; y++)
        delete [] table[y];
      delete [] table;
   }
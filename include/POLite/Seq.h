@@ -37,9 +37,12 @@ template <class T> class Seq
 
     // Set capacity of sequence
     void setCapacity(int n) {
+      // Number of elements to preserve (numElems may already
+      // include elements beyond the old capacity)
+      int keep = numElems < maxElems ? numElems : maxElems;
       maxElems = n;
       T* newElems = new T[maxElems];
-      for (int i = 0; i < numElems-1; i++)
+      for (int i = 0; i < keep; i++)
         newElems[i] = elems[i];
       delete [] elems;
       elems = newElems;
@@ -41,6 +41,18 @@ typedef enum {
   // to start.
   StartCmd,
 
+  // Store a block of words to data memory and increment address register.
+  // Argument: the number of max-sized messages that follow, each
+  // carrying 1 << TinselLogWordsPerMsg words of raw data to store.
+  // The address is taken from the address register.
+  StoreBlockCmd,
+
+  // Load a block of words from data memory and increment address register.
+  // Argument: the number of max-sized messages to send back to the host,
+  // each carrying 1 << TinselLogWordsPerMsg words.
+  // The address is taken from the address register.
+  LoadBlockCmd,
+
 } BootCmd;
 
 